@@ -0,0 +1,37 @@
+#!/bin/bash
+# Regression test for build_db: the octree must not depend on the number of threads that built it.
+# Usage: build_db-test.sh path/to/build_db path/to/ascii2bin
+set -e
+BUILD_DB=$(realpath "$1")
+ASCII2BIN=$(realpath "$2")
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+cd $DIR
+mkdir vxl
+
+# A fixed set of points on a sphere, in random order and with several points in some voxels.
+awk 'BEGIN {
+  srand(1);
+  for (i=0; i<400000; i++) {
+    z = 2*rand() - 1; a = 6.2831853*rand(); r = sqrt(1 - z*z);
+    printf "%d %d %d %06x\n", 1000 + 900*r*cos(a), 1000 + 900*r*sin(a), 1000 + 900*z, int(rand()*16777216);
+  }
+}' > vxl/points.vxl.txt
+$ASCII2BIN points > /dev/null 2>&1
+
+# Builds the octree with the given number of threads and options, from a copy of the unsorted points.
+build() {
+  threads=$1; shift
+  cp vxl/points.vxl in.vxl
+  VOXEL_THREADS=$threads $BUILD_DB "$@" in.vxl out-$threads.oc2 > /dev/null
+}
+
+for options in "" "-memory 1" "-split-colors" "-bricks -palette 16" "-density -max-depth 6"; do
+  build 1 $options
+  build 8 $options
+  if ! cmp -s out-1.oc2 out-8.oc2; then
+    echo "build_db $options: the octree built with 8 threads differs from the one built with 1 thread."
+    exit 1
+  fi
+done
+echo "build_db writes the same octrees with 1 and 8 threads."
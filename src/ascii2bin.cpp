@@ -21,7 +21,7 @@
 #include <algorithm>
 #include <unistd.h>
 
-#include "pointset.h"
+#include "ingest.h"
 
 /* Accepts files with lines of the format:
  * x y z color
@@ -51,26 +51,17 @@ int main(int argc, char ** argv) {
   }
   
   // Open the files.
-  FILE * res;
-  res = freopen( infile,  "r", stdin );
-  if (res==NULL) {
-    fprintf(stderr,"Failed to open '%s' for input.\n", infile);
-    exit(2);
-  }
+  textfile in(infile);
   pointfile out(outfile);
 
-  // Do the conversion
-  point p;
-  int line=0;
-  for(;;) {
-    if(line%(1<<20)==0) fprintf(stderr,"line: %3dMi\n", line>>20);
-    int ret = scanf("%u %u %u %x\n", &p.x, &p.y, &p.z, &p.c);
-    if (ret < 4) break;
-    p.c = ((p.c&0xff)<<16)|(p.c&0xff00)|((p.c&0xff0000)>>16);
-    out.add(p);
-    line++;
-  }
-  fprintf(stderr,"lines: %d\n", line);
+  // Do the conversion, lines that do not contain 4 numbers are skipped.
+  uint64_t count = convert_lines(in, in.data, out, [](int, const char * p, const char * end, std::vector<point> &points) {
+    point q;
+    if (!(parse_uint(p, end, q.x) && parse_uint(p, end, q.y) && parse_uint(p, end, q.z) && parse_hex(p, end, q.c))) return;
+    q.c = ((q.c&0xff)<<16)|(q.c&0xff00)|((q.c&0xff0000)>>16);
+    points.push_back(q);
+  });
+  fprintf(stderr,"lines: %lu\n", count);
 }
 
 // kate: space-indent on; indent-width 2; mixedindent off; indent-mode cstyle; 
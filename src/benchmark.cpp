@@ -27,6 +27,7 @@
 #include <string>
 
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include "timing.h"
 #include "art.h"
@@ -74,6 +75,19 @@ static const int N = 0;
 static const int N = 5;
 #endif
 
+/** Chooses how the model is loaded, based on the sizes in the header of the file, which does not read the data pages.
+ * Models that fit in half of the physical memory are loaded completely before they are timed, 
+ * such that the timings do not depend on which pages were read by earlier runs. Larger models are loaded on demand.
+ */
+static octree_loading residency(const octree_header &header) {
+    uint64_t bytes = header.node_size;
+    if (header.flags & OCTREE_SPLIT_COLORS) {
+        bytes += (uint64_t)header.color_count * header.color_bytes();
+    }
+    uint64_t memory = (uint64_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGE_SIZE);
+    return bytes <= memory / 2 ? OCTREE_PROGRESSIVE : OCTREE_MAPPED;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 
 int main(int argc, char ** argv) {
@@ -93,7 +107,9 @@ int main(int argc, char ** argv) {
         // Load file
         char infile[64];
         sprintf(infile, "../vxl/%s.oc2", scene[i].filename);
-        octree_file in(infile);
+        octree_loading loading = residency(octree_file(infile).header);
+        octree_file in(infile, loading);
+        while (in.loading()) usleep(10000);
         
         // Set camera
         uint32_t background = scene[i].background;
@@ -22,14 +22,22 @@
 #include <cassert>
 #include <ctime>
 #include <algorithm>
+#include <vector>
+#include <map>
+#include <string>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <errno.h>
 
 #include "pointset.h"
+#include "lasfile.h"
+#include "plyfile.h"
+#include "hilbert.h"
+#include "color.h"
 #include "timing.h"
 #include "octree.h"
+#include "parallel.h"
 
 // For outputing the elapsed time.
 static Timer t;
@@ -55,116 +63,356 @@ struct human_filesize {
  * Note that the sorting procedure has a bound of 21 layers,
  * because 64 bits/3 bits = 21.
  */
-static const int D = 21;
-
-static const uint64_t B[] = {
-  0xFFFF00000000FFFF, 
-  0x00FF0000FF0000FF, 
-  0xF00F00F00F00F00F, 
-  0x30C30C30C30C30C3, 
-  0x9249249249249249,
+static const int D = octree_header::LAYERS;
+
+/** A point together with its position on the hilbert curve. */
+struct keyed_point {
+  uint64_t key;
+  point p;
 };
-static const uint64_t S[] = {32, 16, 8, 4, 2};
-    
-uint64_t morton3d( uint64_t x, uint64_t y, uint64_t z ) {   
-  // pack 3 32-bit indices into a 96-bit Morton code
-  // except that the result is truncated to 64-bit.
-  for (uint64_t i=0; i<5; i++) {
-    x = (x | (x << S[i])) & B[i];
-    y = (y | (y << S[i])) & B[i];
-    z = (z | (z << S[i])) & B[i];
-  }
-  return x | (y<<1) | (z<<2);
-}
-
-uint64_t hilbert3d( const point & p ) {
-  uint64_t val = morton3d( p.x,p.y,p.z );
-  uint64_t start = 0;
-  uint64_t end = 1; // can be 1,2,4
-  uint64_t ret = 0;
-  for (int64_t j=19; j>=0; j--) {
-    uint64_t rg = ((val>>(3*j))&7) ^ start;
-    uint64_t travel_shift = (0x30210 >> (start ^ end)*4)&3;
-    uint64_t i = (((rg << 3) | rg) >> travel_shift ) & 7;
-    i = (0x54672310 >> i*4) & 7;
-    ret = (ret<<3) | i;
-    uint64_t si = (0x64422000 >> i*4 ) & 7; // next lower even number, or 0
-    uint64_t ei = (0x77755331 >> i*4 ) & 7; // next higher odd number, or 7
-    uint64_t sg = ( si ^ (si>>1) ) << travel_shift;
-    uint64_t eg = ( ei ^ (ei>>1) ) << travel_shift;
-    end   = ( ( eg | ( eg >> 3 ) ) & 7 ) ^ start;
-    start = ( ( sg | ( sg >> 3 ) ) & 7 ) ^ start;
-  }
-  return ret;
+
+/** Collapses the points in the same voxel into one point with their average color.
+ * The number of points minus one can be stored in the upper 8 bits of the color, saturating at 255, as the density of the voxel.
+ * Points that were collapsed before, for example in the runs of the external sort, keep their weight this way,
+ * although their color was rounded. Hence the upper 8 bits of the input colors must be cleared, see compute_keys.
+ */
+struct voxel_sum {
+  point p;
+  color_sum sum;
+  voxel_sum() : p(0, 0, 0, 0) {}
+  voxel_sum(const point &q) : p(q) { add(q); }
+  void add(const point &q) {
+    sum.add(q.c, (q.c >> 24) + 1);
+  }
+  /** Returns the collapsed point, with the density in the upper 8 bits of its color if requested. */
+  point result(bool density) const {
+    point q = p;
+    q.c = sum.color();
+    if (density) q.c |= (std::min<uint64_t>(sum.n, 256) - 1) << 24;
+    return q;
+  }
+};
+
+static inline bool same_voxel(const point &a, const point &b) {
+  return a.x == b.x && a.y == b.y && a.z == b.z;
 }
-    
-bool hilbert3d_compare( const point & p1,const point & p2 ) {
-  uint64_t val1 = morton3d( p1.x,p1.y,p1.z );
-  uint64_t val2 = morton3d( p2.x,p2.y,p2.z );
-  uint64_t start = 0;
-  uint64_t end = 1; // can be 1,2,4
-  for (int64_t j=19; j>=0; j--) {
-    uint64_t travel_shift = (0x30210 >> (start ^ end)*4)&3;
-    uint64_t rg1 = ((val1>>(3*j))&7) ^ start;
-    uint64_t rg2 = ((val2>>(3*j))&7) ^ start;
-    uint64_t i1 = (((rg1 << 3) | rg1) >> travel_shift ) & 7;
-    uint64_t i2 = (((rg2 << 3) | rg2) >> travel_shift ) & 7;
-    i1 = (0x54672310 >> i1*4) & 7;
-    i2 = (0x54672310 >> i2*4) & 7;
-    if (i1<i2) return true;
-    if (i1>i2) return false;
-    uint64_t si = (0x64422000 >> i1*4 ) & 7; // next lower even number, or 0
-    uint64_t ei = (0x77755331 >> i1*4 ) & 7; // next higher odd number, or 7
-    uint64_t sg = ( si ^ (si>>1) ) << travel_shift;
-    uint64_t eg = ( ei ^ (ei>>1) ) << travel_shift;
-    end   = ( ( eg | ( eg >> 3 ) ) & 7 ) ^ start;
-    start = ( ( sg | ( sg >> 3 ) ) & 7 ) ^ start;
-  }
-  return false;
+
+/** Computes the hilbert keys of the given points in parallel. 
+ * The upper 8 bits of the colors are cleared, as these are not part of the input and would be taken as a density.
+ */
+void compute_keys(const point * list, keyed_point * keyed, uint64_t length) {
+  parallel_ranges(length, [&](int, uint64_t begin, uint64_t end) {
+    for (uint64_t i=begin; i<end; i++) {
+      keyed[i].key = hilbert3d(list[i]);
+      keyed[i].p = list[i];
+      keyed[i].p.c &= 0xffffff;
+    }
+  });
 }
 
-#define CLAMP(x,l,u) (x<l?l:x>u?u:x)
-uint32_t rgb(int32_t r, int32_t g, int32_t b) {
-  return (CLAMP(r,0,255)<<16)|(CLAMP(g,0,255)<<8)|(CLAMP(b,0,255));
+/** Sorts the points in a by their key using a parallel LSD radix sort, which is stable. 
+ * Uses b as scratch space and returns which of the two contains the result.
+ */
+keyed_point * radix_sort(keyed_point * a, keyed_point * b, uint64_t length) {
+  const int BITS = 12;
+  const int RADIX = 1 << BITS;
+  const int KEY_BITS = 60; // hilbert3d uses 20 levels.
+  int threads = thread_count();
+  std::vector<uint64_t> count(threads * RADIX);
+  for (int shift=0; shift<KEY_BITS; shift+=BITS) {
+    std::fill(count.begin(), count.end(), 0);
+    parallel_ranges(length, [&](int thread, uint64_t begin, uint64_t end) {
+      uint64_t * c = &count[thread * RADIX];
+      for (uint64_t i=begin; i<end; i++) {
+        c[(a[i].key >> shift) & (RADIX-1)]++;
+      }
+    });
+    // Compute where each thread stores the points of each digit.
+    uint64_t offset = 0;
+    bool skip = false;
+    for (int d=0; d<RADIX; d++) {
+      uint64_t total = 0;
+      for (int i=0; i<threads; i++) {
+        uint64_t n = count[i * RADIX + d];
+        count[i * RADIX + d] = offset + total;
+        total += n;
+      }
+      // The pass can be skipped if all points have the same digit.
+      if (total == length) skip = true;
+      offset += total;
+    }
+    if (skip) continue;
+    parallel_ranges(length, [&](int thread, uint64_t begin, uint64_t end) {
+      uint64_t * c = &count[thread * RADIX];
+      for (uint64_t i=begin; i<end; i++) {
+        b[c[(a[i].key >> shift) & (RADIX-1)]++] = a[i];
+      }
+    });
+    std::swap(a, b);
+  }
+  return a;
 }
-uint32_t rgb(double r, double g, double b) {
-  return rgb((int32_t)(r+0.5),(int32_t)(g+0.5),(int32_t)(b+0.5));
+
+/** Position in the sorted points at which the construction of the octree can be split. */
+struct checkpoint {
+  uint64_t index;       //< Index of the point.
+  int level;            //< The point is the first point of a node in each layer up to and including level.
+  uint64_t nodecount[D];//< Number of nodes per layer that precede the point.
+};
+
+/** Counts the number of nodes per layer of hilbert sorted points, while they are being sorted or checked.
+ * As the hilbert key of a point at layer j is a bijection of its morton code at layer j, 
+ * the hilbert keys can be used instead of the morton codes. It also records a checkpoint 
+ * every CHECKPOINT_INTERVAL points, at the point within the interval that starts the highest node.
+ */
+struct layer_counter {
+  static const uint64_t CHECKPOINT_INTERVAL = 1<<16;
+  uint64_t nodecount[D];
+  uint64_t max_key;
+  uint32_t min[3]; //< Bounding box of the points.
+  uint32_t max[3];
+  uint64_t index;  //< Index of the next point.
+  uint64_t old;    //< Key of the previous point.
+  uint64_t collapsed; //< Number of points that were collapsed into another point in the same voxel.
+  std::vector<checkpoint> checkpoints;
+  
+  /** Creates a counter for the points starting at the given index, with the given key for the preceding point. */
+  layer_counter(uint64_t index = 0, uint64_t old = ~0ull) : max_key(0), index(index), old(old), collapsed(0) {
+    std::fill(nodecount, nodecount + D, 0);
+    for (int j=0; j<3; j++) {min[j]=~0u; max[j]=0;}
+  }
+  void add(uint64_t key, const point &q) {
+    uint64_t diff = key ^ old;
+    int level = diff ? std::min((63 - __builtin_clzll(diff)) / 3, D-1) : -1;
+    if (index % CHECKPOINT_INTERVAL == 0 || checkpoints.empty() || level > checkpoints.back().level) {
+      if (index % CHECKPOINT_INTERVAL == 0 || checkpoints.empty()) checkpoints.push_back(checkpoint());
+      checkpoint &c = checkpoints.back();
+      c.index = index;
+      c.level = level;
+      std::copy(nodecount, nodecount + D, c.nodecount);
+    }
+    for (int j=0; j<=level; j++) {
+      nodecount[j]++;
+    }
+    max_key = std::max(max_key, key);
+    min[0] = std::min(min[0], q.x); max[0] = std::max(max[0], q.x);
+    min[1] = std::min(min[1], q.y); max[1] = std::max(max[1], q.y);
+    min[2] = std::min(min[2], q.z); max[2] = std::max(max[2], q.z);
+    old = key;
+    index++;
+  }
+  /** Appends the counts of the points that follow the points counted by this counter. */
+  void append(const layer_counter &next) {
+    assert(next.index >= index);
+    for (checkpoint c : next.checkpoints) {
+      for (int j=0; j<D; j++) c.nodecount[j] += nodecount[j];
+      checkpoints.push_back(c);
+    }
+    for (int j=0; j<D; j++) nodecount[j] += next.nodecount[j];
+    max_key = std::max(max_key, next.max_key);
+    for (int j=0; j<3; j++) {
+      min[j] = std::min(min[j], next.min[j]);
+      max[j] = std::max(max[j], next.max[j]);
+    }
+    index = next.index;
+    old = next.old;
+    collapsed += next.collapsed;
+  }
+};
+
+/** Memory needed per point to sort points in memory. */
+static const uint64_t SORT_MEMORY = 2 * sizeof(keyed_point);
+
+/** Sorts the points along the hilbert curve in memory, which requires SORT_MEMORY bytes per point.
+ * Points in the same voxel are collapsed into one point, see voxel_sum, which records the density if requested. 
+ * The remaining points are passed to store(points, n), which must copy them, as they are kept in a scratch buffer.
+ * Hence the caller can decide where to store them based on whether points were collapsed. 
+ * Returns the number of remaining points. The nodes are counted while the sorted points are collapsed.
+ */
+template<class F>
+uint64_t radix_sort_points(const point * list, uint64_t length, layer_counter &counter, bool density, F store) {
+  keyed_point * a = new keyed_point[length];
+  keyed_point * b = new keyed_point[length];
+  compute_keys(list, a, length);
+  keyed_point * sorted = radix_sort(a, b, length);
+  // Each thread collapses the voxels whose first point is in its range, hence the output position of a thread
+  // follows from the number of voxels that start in the preceding ranges.
+  int threads = thread_count();
+  auto starts = [&](uint64_t i) { return i == 0 || !same_voxel(sorted[i].p, sorted[i-1].p); };
+  std::vector<uint64_t> offset(threads + 1, 0);
+  parallel_ranges(length, [&](int thread, uint64_t begin, uint64_t end) {
+    for (uint64_t i=begin; i<end; i++) {
+      offset[thread + 1] += starts(i);
+    }
+  });
+  for (int i=0; i<threads; i++) {
+    offset[i + 1] += offset[i];
+  }
+  // The keys are stripped and the points are collapsed into the scratch buffer of the radix sort.
+  point * points = (point*)(sorted == a ? b : a);
+  std::vector<layer_counter> counters(threads);
+  parallel_ranges(length, [&](int thread, uint64_t begin, uint64_t end) {
+    layer_counter &c = counters[thread];
+    c = layer_counter(counter.index + offset[thread], begin > 0 ? sorted[begin-1].key : counter.old);
+    uint64_t out = offset[thread];
+    for (uint64_t i=begin; i<end; i++) {
+      if (!starts(i)) continue;
+      voxel_sum v(sorted[i].p);
+      for (uint64_t j=i+1; j<length && !starts(j); j++) v.add(sorted[j].p);
+      points[out] = v.result(density);
+      c.add(sorted[i].key, points[out++]);
+    }
+  });
+  for (const layer_counter &c : counters) {
+    counter.append(c);
+  }
+  counter.collapsed += length - offset[threads];
+  store((const point*)points, offset[threads]);
+  delete[] a;
+  delete[] b;
+  return offset[threads];
+}
+
+/** Sorts the points in memory and stores the remaining points at the start of the list. See radix_sort_points above. */
+uint64_t radix_sort_points(point * list, uint64_t length, layer_counter &counter, bool density) {
+  return radix_sort_points(list, length, counter, density, [&](const point * points, uint64_t n) {
+    std::copy(points, points + n, list);
+  });
 }
 
-struct weighted_color {
-  double r,g,b;
-  uint64_t n;
-  weighted_color() : r(0), g(0), b(0), n(0) {}
-  weighted_color(uint32_t v) : r((v&0xff0000)>>16), g((v&0xff00)>>8), b((v&0xff)), n(1) {
-    assert(0<=r && r<=255);
-    assert(0<=g && g<=255);
-    assert(0<=b && b<=255);
-  }
-  void operator+=(const weighted_color &w) {
-    r+=w.r;
-    g+=w.g;
-    b+=w.b;
-    n+=w.n;
-  }
-  uint32_t color() {
-    assert(n>0);
-    assert(0<=r && r<=255.*n);
-    assert(0<=g && g<=255.*n);
-    assert(0<=b && b<=255.*n);
-    return rgb(r/n,g/n,b/n);
+/** Reads the points of a sorted run during the k-way merge of external_sort_points. */
+struct run_reader {
+  int fd;
+  point * buffer;
+  uint64_t buffer_size; //< Number of points in the buffer.
+  uint64_t pos, end;
+  keyed_point head; //< The next point of the run.
+  /** Reads the next point into head, returns false if the run is exhausted. */
+  bool next() {
+    if (pos == end) {
+      ssize_t r = read(fd, buffer, buffer_size * sizeof(point));
+      if (r < 0) {perror("Could not read sorted run"); exit(1);}
+      pos = 0;
+      end = r / sizeof(point);
+      if (end == 0) return false;
+    }
+    head.p = buffer[pos++];
+    head.key = hilbert3d(head.p);
+    return true;
   }
 };
-// Note: recursive function, assumes that the octree is indeed a tree.
-weighted_color average(octree* root, uint32_t index) {
-  octree &node = root[index];
-  int n = node.size();
-  assert(n>0);
-  weighted_color c;
-  for (int i=0; i<n; i++) {
-    c += node.is_pointer(i) ? average(root, node.child[i]) : weighted_color(node.color(i));
+
+/** Sorts the points along the hilbert curve, using at most memory bytes (approximately) and writes them to the output file. 
+ * The points are split into runs that are sorted in memory and written to temporary files, which are then merged. 
+ * The input can be overwritten by the output, as the input is no longer read once the runs have been written.
+ * Points in the same voxel are collapsed within the runs and during the merge. The runs always store the densities, 
+ * such that the points are weighted correctly during the merge. The output only stores them if requested.
+ * The nodes are counted during the merge.
+ */
+void external_sort_points(const char * input, const char * output, uint64_t memory, layer_counter &counter, bool density) {
+  std::vector<int> runs;
+  uint64_t input_length;
+  {
+    pointwindow in(input);
+    input_length = in.length;
+    uint64_t run_length = std::max<uint64_t>(memory / SORT_MEMORY, 1<<16);
+    uint32_t count = (in.length + run_length - 1) / run_length;
+    keyed_point * a = new keyed_point[std::min<uint64_t>(run_length, in.length)];
+    keyed_point * b = new keyed_point[std::min<uint64_t>(run_length, in.length)];
+    for (uint64_t start=0; start<in.length; start+=run_length) {
+      uint64_t length = std::min<uint64_t>(run_length, in.length - start);
+      printf("[%10.0f] Sorting run %lu of %u.\n", t.elapsed(), runs.size()+1, count);
+      // The run can span several windows of the input.
+      for (uint64_t done=0; done<length; ) {
+        if (start + done == in.end) in.next();
+        uint64_t n = std::min(length - done, in.end - (start + done));
+        compute_keys(in.list + (start + done - in.begin), a + done, n);
+        done += n;
+      }
+      keyed_point * sorted = radix_sort(a, b, length);
+      // The run is written next to the output file and is removed as soon as it is closed.
+      char filename[4096];
+      snprintf(filename, sizeof(filename), "%s.run%lu", output, runs.size());
+      int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0600);
+      if (fd == -1) {perror("Could not create temporary file"); exit(1);}
+      unlink(filename);
+      // Strip the keys, as they are cheaper to recompute than to read. The scratch buffer is reused for this.
+      point * points = (point*)(sorted == a ? b : a);
+      uint64_t n = 0;
+      for (uint64_t i=0; i<length; ) {
+        voxel_sum v(sorted[i].p);
+        for (i++; i<length && same_voxel(sorted[i].p, v.p); i++) v.add(sorted[i].p);
+        points[n++] = v.result(true);
+      }
+      for (uint64_t done=0; done<n*sizeof(point); ) {
+        ssize_t r = write(fd, (char*)points + done, n*sizeof(point) - done);
+        if (r <= 0) {perror("Could not write sorted run"); exit(1);}
+        done += r;
+      }
+      lseek(fd, 0, SEEK_SET);
+      runs.push_back(fd);
+    }
+    delete[] a;
+    delete[] b;
+  }
+  
+  // Merge the runs.
+  printf("[%10.0f] Merging %lu runs into '%s'.\n", t.elapsed(), runs.size(), output);
+  std::vector<run_reader> readers(runs.size());
+  uint64_t buffer_size = std::max<uint64_t>(memory / (runs.size() + 1) / sizeof(point), 1<<12);
+  // Points with equal keys are taken from the earliest run, such that the sort is stable.
+  auto later = [&](uint32_t x, uint32_t y) { 
+    return readers[x].head.key > readers[y].head.key || (readers[x].head.key == readers[y].head.key && x > y); 
+  };
+  std::vector<uint32_t> heap;
+  for (uint32_t i=0; i<runs.size(); i++) {
+    readers[i].fd = runs[i];
+    readers[i].buffer = new point[buffer_size];
+    readers[i].buffer_size = buffer_size;
+    readers[i].pos = readers[i].end = 0;
+    if (readers[i].next()) heap.push_back(i);
+  }
+  std::make_heap(heap.begin(), heap.end(), later);
+  pointfile out(output);
+  uint64_t written = 0;
+  voxel_sum voxel;
+  uint64_t key = 0;
+  auto flush = [&]() {
+    point p = voxel.result(density);
+    out.add(p);
+    counter.add(key, p);
+    written++;
+  };
+  while (!heap.empty()) {
+    std::pop_heap(heap.begin(), heap.end(), later);
+    run_reader &r = readers[heap.back()];
+    if (voxel.sum.n && same_voxel(r.head.p, voxel.p)) {
+      voxel.add(r.head.p);
+    } else {
+      if (voxel.sum.n) flush();
+      voxel = voxel_sum(r.head.p);
+      key = r.head.key;
+    }
+    if (r.next()) {
+      std::push_heap(heap.begin(), heap.end(), later);
+    } else {
+      heap.pop_back();
+    }
+  }
+  if (voxel.sum.n) flush();
+  counter.collapsed += input_length - written;
+  for (run_reader &r : readers) {
+    delete[] r.buffer;
+    close(r.fd);
   }
-  node.avgcolor = c.color();
-  return c;
+}
+
+#define CLAMP(x,l,u) (x<l?l:x>u?u:x)
+uint32_t rgb(int32_t r, int32_t g, int32_t b) {
+  return (CLAMP(r,0,255)<<16)|(CLAMP(g,0,255)<<8)|(CLAMP(b,0,255));
+}
+uint32_t rgb(double r, double g, double b) {
+  return rgb((int32_t)(r+0.5),(int32_t)(g+0.5),(int32_t)(b+0.5));
 }
 
 static uint32_t mask2bitmask[]={0x01,0x03,0x05,0x0f,0x11,0x33,0x55,0xff};
@@ -180,44 +428,212 @@ void replicate(octree* root, int index, uint32_t mask, uint32_t depth) {
   }
 }
 
+/** Number of layers spanned by the bounding box of a PLY file, if not given with -depth. */
+static const int DEFAULT_DEPTH = 16;
+
+/** An additional octree file with at most the given size, created by collapsing the lower layers into leaves. */
+struct level_of_detail {
+  uint64_t size;
+  const char * filename;
+};
+
 struct arguments {
   const char * infile;
   const char * outfile;
   int repeat_mask;
   int repeat_depth;
+  bool split_colors;
+  bool bricks;
+  int palette;
+  bool density;        //< Store the number of points per voxel in the sorted points and weight the leaf colors by it.
+  uint64_t memory; //< Memory available for sorting in bytes.
+  const char * sorted; //< File to which the sorted points are written, or nullptr to sort in place.
+  std::vector<const char *> merge; //< Existing octrees with which the points are merged.
+  int leaf_layer;      //< Layer in which the leaves are stored, or -1 to choose it based on the number of nodes.
+  uint32_t crop_min[3];//< Box outside which merged octrees are cropped, inclusive.
+  uint32_t crop_max[3];
+  const char * exported; //< File to which the leaves are written as points, or nullptr.
+  int max_depth;       //< Maximum number of layers above the leaves, or 0 if unlimited.
+  uint64_t max_bytes;  //< Maximum size of the node array, or 0 if unlimited.
+  std::vector<level_of_detail> lods;
+  double resolution;   //< Size of a voxel in the units of a LAS input file, or 0 to use the resolution of the file.
+  int depth;           //< Number of layers spanned by the bounding box of a LAS or PLY input file, or 0 for the default.
 };
 
+static void usage(const char * name) {
+  fprintf(stderr,"Usage: %s [options] input_file output_file [repeat_mask repeat_depth]\n", name);
+  fprintf(stderr,"       %s [options] -merge FILE [-merge FILE ...] output_file [repeat_mask repeat_depth]\n", name);
+  fprintf(stderr,"Converts a poinlist (*.vxl) into an octree (*.oc2). Use - as input_file to read the points from standard input.\n");
+  fprintf(stderr,"The input_file can also be a LiDAR point cloud in LAS format (*.las), with point data format 0 to 3,\n");
+  fprintf(stderr,"or a point cloud in binary little endian PLY format (*.ply).\n");
+  fprintf(stderr,"Options:\n");
+  fprintf(stderr,"  -split-colors  Store the colors in an array separate from the nodes, without leaf nodes.\n");
+  fprintf(stderr,"  -bricks        Store the lowest 2 layers as 4x4x4 bricks (cannot be combined with -split-colors).\n");
+  fprintf(stderr,"  -palette N     Quantize the colors to a palette of N colors, with 2 <= N <= 4096. Implies -split-colors without -bricks.\n");
+  fprintf(stderr,"  -density       Store the number of points in each voxel in the upper 8 bits of the colors of the sorted points,\n");
+  fprintf(stderr,"                 and weight the colors of leaves that contain several voxels by it.\n");
+  fprintf(stderr,"  -memory N      Use at most N MiB of memory for sorting. Defaults to half of the physical memory.\n");
+  fprintf(stderr,"  -sorted FILE   Write the sorted points to FILE instead of sorting the input in place.\n");
+  fprintf(stderr,"                 Defaults to output_file with extension .sorted.vxl if the input is read only, does not fit\n");
+  fprintf(stderr,"                 in memory or contains several points in the same voxel.\n");
+  fprintf(stderr,"  -merge FILE    Add the points to the octree in FILE, which must not use -bricks, -split-colors or -palette.\n");
+  fprintf(stderr,"                 Only the parts of the octree that contain new points are rebuilt. If given multiple times,\n");
+  fprintf(stderr,"                 the octrees are combined, for example tiles that are built separately. The input_file is optional.\n");
+  fprintf(stderr,"  -leaf-layer N  Store the leaves in layer N, such that octrees that are merged have the same leaf size.\n");
+  fprintf(stderr,"                 When merging, the layers below N are collapsed into leaves.\n");
+  fprintf(stderr,"  -crop X0 Y0 Z0 X1 Y1 Z1\n");
+  fprintf(stderr,"                 Only keep the leaves in the given box (inclusive) when merging.\n");
+  fprintf(stderr,"  -export FILE   Also write the leaves of the octree as points (*.vxl) to FILE.\n");
+  fprintf(stderr,"  -max-depth N   Collapse the lower layers into leaves, such that there are at most N layers above the leaves.\n");
+  fprintf(stderr,"  -max-bytes N   Collapse the lower layers into leaves, such that the nodes take at most N bytes.\n");
+  fprintf(stderr,"                 The suffixes k, M and G can be used for KiB, MiB and GiB.\n");
+  fprintf(stderr,"  -lod N FILE    Also write a level of detail that takes at most N bytes to FILE. Can be given multiple times.\n");
+  fprintf(stderr,"  -resolution R  Size of a voxel in the units of a LAS file (usually meters). Defaults to the precision of the file.\n");
+  fprintf(stderr,"  -depth N       Quantize the points of a LAS or PLY file, such that the longest side of their bounding box\n");
+  fprintf(stderr,"                 spans 2^N voxels, with 1 <= N <= 20. Defaults to %d for PLY files.\n", DEFAULT_DEPTH);
+  exit(2);
+}
+
+/** Parses a number of bytes, with an optional suffix k, M or G. Returns 0 if it is invalid. */
+static uint64_t parse_size(const char * text) {
+  char * endptr = NULL;
+  uint64_t size = strtoull(text, &endptr, 10);
+  if (endptr[0] == 'k') {size <<= 10; endptr++;}
+  else if (endptr[0] == 'M') {size <<= 20; endptr++;}
+  else if (endptr[0] == 'G') {size <<= 30; endptr++;}
+  return endptr[0] == 0 ? size : 0;
+}
+
 arguments parse_arguments(int argc, char ** argv) {
-  static const int ARG_INFILE = 1;
-  static const int ARG_OUTFILE = 2;
-  static const int ARG_REPEAT_MASK = 3;
-  static const int ARG_REPEAT_DEPTH = 4;
+  static const int ARG_INFILE = 0;
+  static const int ARG_OUTFILE = 1;
+  static const int ARG_REPEAT_MASK = 2;
+  static const int ARG_REPEAT_DEPTH = 3;
   arguments r;
   r.repeat_mask = 7;
   r.repeat_depth = 0;
+  r.split_colors = false;
+  r.bricks = false;
+  r.palette = 0;
+  r.density = false;
+  r.memory = (uint64_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGE_SIZE) / 2;
+  r.sorted = nullptr;
+  r.leaf_layer = -1;
+  for (int j=0; j<3; j++) {
+    r.crop_min[j] = 0;
+    r.crop_max[j] = ~0u;
+  }
+  r.exported = nullptr;
+  r.max_depth = 0;
+  r.max_bytes = 0;
+  r.resolution = 0;
+  r.depth = 0;
 
-  if (argc != 3 && argc != 5) {
-    fprintf(stderr,"Usage: %s input_file output_file [repeat_mask repeat_depth]\n", argv[0]);
-    fprintf(stderr,"Converts a poinlist (*.vxl) into an octree (*.oc2).\n");
+  // Separate the options from the positional arguments.
+  const char * args[4];
+  int n = 0;
+  for (int i=1; i<argc; i++) {
+    if (argv[i][0]=='-' && argv[i][1]!=0) {
+      if (strcmp(argv[i], "-split-colors") == 0) {
+        r.split_colors = true;
+      } else if (strcmp(argv[i], "-bricks") == 0) {
+        r.bricks = true;
+      } else if (strcmp(argv[i], "-palette") == 0 && i+1 < argc) {
+        char * endptr = NULL;
+        r.palette = strtol(argv[++i], &endptr, 10);
+        if (endptr[0] != 0 || r.palette < 2 || r.palette > 4096) usage(argv[0]);
+      } else if (strcmp(argv[i], "-density") == 0) {
+        r.density = true;
+      } else if (strcmp(argv[i], "-memory") == 0 && i+1 < argc) {
+        char * endptr = NULL;
+        r.memory = strtoull(argv[++i], &endptr, 10) << 20;
+        if (endptr[0] != 0 || r.memory == 0) usage(argv[0]);
+      } else if (strcmp(argv[i], "-sorted") == 0 && i+1 < argc) {
+        r.sorted = argv[++i];
+      } else if (strcmp(argv[i], "-merge") == 0 && i+1 < argc) {
+        r.merge.push_back(argv[++i]);
+      } else if (strcmp(argv[i], "-leaf-layer") == 0 && i+1 < argc) {
+        char * endptr = NULL;
+        r.leaf_layer = strtol(argv[++i], &endptr, 10);
+        if (endptr[0] != 0 || r.leaf_layer < 0 || r.leaf_layer >= D - 1) usage(argv[0]);
+      } else if (strcmp(argv[i], "-crop") == 0 && i+6 < argc) {
+        for (int j=0; j<6; j++) {
+          char * endptr = NULL;
+          uint32_t v = strtoul(argv[++i], &endptr, 10);
+          if (endptr[0] != 0) usage(argv[0]);
+          (j < 3 ? r.crop_min : r.crop_max)[j%3] = v;
+        }
+        if (r.crop_min[0] > r.crop_max[0] || r.crop_min[1] > r.crop_max[1] || r.crop_min[2] > r.crop_max[2]) usage(argv[0]);
+      } else if (strcmp(argv[i], "-export") == 0 && i+1 < argc) {
+        r.exported = argv[++i];
+      } else if (strcmp(argv[i], "-max-depth") == 0 && i+1 < argc) {
+        char * endptr = NULL;
+        r.max_depth = strtol(argv[++i], &endptr, 10);
+        if (endptr[0] != 0 || r.max_depth <= 0) usage(argv[0]);
+      } else if (strcmp(argv[i], "-max-bytes") == 0 && i+1 < argc) {
+        r.max_bytes = parse_size(argv[++i]);
+        if (r.max_bytes == 0) usage(argv[0]);
+      } else if (strcmp(argv[i], "-lod") == 0 && i+2 < argc) {
+        level_of_detail lod;
+        lod.size = parse_size(argv[++i]);
+        lod.filename = argv[++i];
+        if (lod.size == 0) usage(argv[0]);
+        r.lods.push_back(lod);
+      } else if (strcmp(argv[i], "-resolution") == 0 && i+1 < argc) {
+        char * endptr = NULL;
+        r.resolution = strtod(argv[++i], &endptr);
+        if (endptr[0] != 0 || !(r.resolution > 0)) usage(argv[0]);
+      } else if (strcmp(argv[i], "-depth") == 0 && i+1 < argc) {
+        char * endptr = NULL;
+        r.depth = strtol(argv[++i], &endptr, 10);
+        if (endptr[0] != 0 || r.depth < 1 || r.depth > 20) usage(argv[0]);
+      } else {
+        fprintf(stderr,"unrecognized option: %s\n", argv[i]);
+        usage(argv[0]);
+      }
+    } else {
+      if (n == 4) usage(argv[0]);
+      args[n++] = argv[i];
+    }
+  }
+  // The input file can be omitted if octrees are merged.
+  int skip = r.merge.empty() || n == 2 || n == 4 ? 0 : 1;
+  if (n + skip != 2 && n + skip != 4) usage(argv[0]);
+  if (r.split_colors && r.bricks) usage(argv[0]);
+  // Palette indices only save space in the compact color stores, hence the colors are split from the nodes if there are no bricks.
+  if (r.palette && !r.bricks) r.split_colors = true;
+  if (r.resolution && r.depth) usage(argv[0]);
+  if (!r.merge.empty() && (r.max_depth || r.max_bytes || !r.lods.empty())) {
+    fprintf(stderr,"The -max-depth, -max-bytes and -lod options cannot be used with -merge, use -leaf-layer instead.\n");
+    exit(2);
+  }
+  if (r.merge.empty() && (r.crop_min[0] || r.crop_min[1] || r.crop_min[2] || ~r.crop_max[0] || ~r.crop_max[1] || ~r.crop_max[2])) {
+    fprintf(stderr,"The -crop option can only be used with -merge.\n");
     exit(2);
   }
 
   // Determine the file names.
-  r.infile  = argv[ARG_INFILE];
-  r.outfile = argv[ARG_OUTFILE];
+  r.infile  = skip ? nullptr : args[ARG_INFILE];
+  r.outfile = args[ARG_OUTFILE - skip];
+  for (const char * merge : r.merge) {
+    if (strcmp(merge, r.outfile) == 0) {
+      fprintf(stderr,"The merged octree must be written to a different file.\n");
+      exit(2);
+    }
+  }
   time_t rawtime = std::time(NULL);
   std::tm * timeinfo = std::localtime(&rawtime);
-  printf("[%10.0f] Conversion of pointfile %s into octree %s started at %d:%02d:%02d.\n", t.elapsed(), r.infile, r.outfile, timeinfo->tm_hour, timeinfo->tm_min, timeinfo->tm_sec);
+  printf("[%10.0f] Conversion of pointfile %s into octree %s started at %d:%02d:%02d.\n", t.elapsed(), r.infile ? r.infile : "(none)", r.outfile, timeinfo->tm_hour, timeinfo->tm_min, timeinfo->tm_sec);
 
   // Determine repeat arguments
-  if (argc == 5) {
+  if (n + skip == 4) {
     char * endptr = NULL;
-    r.repeat_mask  = strtol(argv[ARG_REPEAT_MASK], &endptr, 10);
+    r.repeat_mask  = strtol(args[ARG_REPEAT_MASK - skip], &endptr, 10);
     if (errno) {perror("Could not parse mask"); exit(1);}
     assert(endptr);
     assert(endptr[0]==0);
     assert(r.repeat_mask>=0 && r.repeat_mask<8);
-    r.repeat_depth = strtol(argv[ARG_REPEAT_DEPTH], &endptr, 10);
+    r.repeat_depth = strtol(args[ARG_REPEAT_DEPTH - skip], &endptr, 10);
     if (errno) {perror("Could not parse depth"); exit(1);}
     assert(endptr);
     assert(endptr[0]==0);
@@ -229,32 +645,280 @@ arguments parse_arguments(int argc, char ** argv) {
   return r;
 }
 
-void hilbert_sort_points(const arguments &arg, pointset &in) {
-  // Check and possibly sort the data points.
-  printf("[%10.0f] Checking if %d points are sorted.\n", t.elapsed(), in.length);
-  int64_t old = 0;
-  for (uint64_t i=0; i<in.length; i++) {
-    if (i && (i&0x3fffff)==0) {
-      printf("[%10.0f] Checking ... %6.2f%%.\n", t.elapsed(), i*100.0/in.length);
+/** Returns the default name of the sorted points file for a read only input, which is derived from the output file. */
+static const char * sorted_filename(const char * outfile) {
+  static char filename[4096];
+  int n = strlen(outfile);
+  if (n >= 4 && strcmp(outfile + n - 4, ".oc2") == 0) n -= 4;
+  snprintf(filename, sizeof(filename), "%.*s.sorted.vxl", n, outfile);
+  return filename;
+}
+
+/** Checks whether the points are sorted along the hilbert curve and sorts them if necessary. 
+ * Points are only considered sorted if there is at most one point per voxel, as sorting collapses such points.
+ * The points are sorted in place if they fit in memory and no points are collapsed, unless a sorted file is given 
+ * or the input is read only. Otherwise the input is kept, such that the original points are not replaced by averages.
+ * The nodes per layer are counted during the final pass over the points, which is either the check or the sort.
+ * Returns the name of the file that contains the sorted points.
+ */
+const char * hilbert_sort_points(const arguments &arg, layer_counter &counter) {
+  uint64_t length;
+  {
+    // Check the data points, which only requires a window of the file.
+    pointwindow in(arg.infile);
+    length = in.length;
+    printf("[%10.0f] Checking if %lu points are sorted.\n", t.elapsed(), in.length);
+    int64_t old = 0;
+    uint64_t i;
+    for (i=0; i<in.length; i++) {
+      if (i && (i&0x3fffff)==0) {
+        printf("[%10.0f] Checking ... %6.2f%%.\n", t.elapsed(), i*100.0/in.length);
+      }
+      if (i == in.end) in.next();
+      const point &p = in.list[i - in.begin];
+      int64_t cur = hilbert3d(p);
+      if (i && old>=cur) break;
+      counter.add(cur, p);
+      old = cur;
     }
-    int64_t cur = hilbert3d(in.list[i]);
-    if (old>cur) {
-      printf("[%10.0f] Point %lu should precede previous point.\n", t.elapsed(), i);
-      if (in.write) {
-        printf("[%10.0f] Sorting points.\n", t.elapsed());
+    if (i == in.length) return arg.infile;
+    printf("[%10.0f] Point %lu should precede previous point or is in the same voxel.\n", t.elapsed(), i);
+    counter = layer_counter();
+  }
+  
+  // Sort the data points.
+  bool writable = arg.sorted == nullptr && access(arg.infile, W_OK) == 0;
+  const char * target = arg.sorted ? arg.sorted : sorted_filename(arg.outfile);
+  if (writable && length * SORT_MEMORY <= arg.memory) {
+    printf("[%10.0f] Sorting points.\n", t.elapsed());
+    pointset in(arg.infile, true);
+    radix_sort_points(in.list, in.length, counter, arg.density, [&](const point * points, uint64_t n) {
+      if (n == in.length) {
+        // No points were collapsed, hence the sorted points replace the input without losing any of them.
         in.enable_write(true);
-        // TODO: replace with IO-efficient k-way quicksort, with inline hilbert curve computation.
-        // TODO: branch into multiple threads at some point if cpu usage is high.
-        std::sort(in.list, in.list+in.length, hilbert3d_compare);
+        std::copy(points, points + n, in.list);
         in.enable_write(false);
+        target = arg.infile;
       } else {
-        printf("[%10.0f] Cannot proceed as '%s' is read only.\n", t.elapsed(), arg.infile);
-        exit(1);
+        printf("[%10.0f] Points in the same voxel were collapsed, writing the sorted points to '%s'.\n", t.elapsed(), target);
+        pointfile out(target);
+        out.add_many(points, n);
       }
-      break;
+    });
+    return target;
+  }
+  printf("[%10.0f] Sorting points into '%s' using at most %lu MiB of memory.\n", t.elapsed(), target, arg.memory >> 20);
+  external_sort_points(arg.infile, target, arg.memory, counter, arg.density);
+  return target;
+}
+
+/** The sorted points, which can be stored in several consecutive arrays. */
+struct sorted_points {
+  std::vector<const point*> parts;
+  std::vector<uint64_t> start; //< Index of the first point of each part.
+  uint64_t length;
+  sorted_points() : length(0) {}
+  void add(const point * list, uint64_t n) {
+    parts.push_back(list);
+    start.push_back(length);
+    length += n;
+  }
+  const point & operator[](uint64_t i) const {
+    if (parts.size() == 1) return parts[0][i];
+    uint32_t k = std::upper_bound(start.begin(), start.end(), i) - start.begin() - 1;
+    return parts[k][i - start[k]];
+  }
+};
+
+/** A bucket of streamed points, which is spilled to temporary files.
+ * A bucket has multiple files if it was created by merging buckets.
+ */
+struct spill_bucket {
+  std::vector<std::string> files;
+  int fd; //< The last file if it is open for writing, otherwise -1.
+  uint64_t count;
+  std::vector<point> buffer;
+  spill_bucket() : fd(-1), count(0) {}
+  void flush() {
+    for (uint64_t done=0; done<buffer.size()*sizeof(point); ) {
+      ssize_t r = write(fd, (char*)buffer.data() + done, buffer.size()*sizeof(point) - done);
+      if (r <= 0) {perror("Could not write to spill file"); exit(1);}
+      done += r;
     }
-    old = cur;
+    buffer.clear();
   }
+  void close() {
+    if (fd != -1) {
+      flush();
+      ::close(fd);
+      fd = -1;
+    }
+  }
+};
+
+/** Points read from standard input or another stream, which are sorted either in memory or in one spill file per bucket. */
+struct streamed_points {
+  sorted_points sorted;
+  std::vector<point> memory;
+  std::vector<std::string> filenames;
+  std::vector<pointset*> buckets;
+  ~streamed_points() {
+    for (pointset * b : buckets) delete b;
+    for (const std::string &f : filenames) unlink(f.c_str());
+  }
+};
+
+/** Reads up to the given number of points from standard input. Returns the number of points read. */
+static uint64_t read_points(point * list, uint64_t count) {
+  uint64_t done = 0;
+  while (done < count * sizeof(point)) {
+    ssize_t r = read(STDIN_FILENO, (char*)list + done, count * sizeof(point) - done);
+    if (r < 0) {perror("Could not read points from standard input"); exit(1);}
+    if (r == 0) break;
+    done += r;
+  }
+  if (done % sizeof(point)) {
+    fprintf(stderr, "Standard input ended with a partial point.\n");
+    exit(1);
+  }
+  return done / sizeof(point);
+}
+
+/** Reads the points from the source and sorts them. The points are obtained by calling read(list, count), 
+ * which stores up to count points in list and returns the number of points stored, or 0 at the end of the input.
+ * If they do not fit in memory, they are partitioned into buckets by the top digits of their hilbert key. The buckets are written to spill files next to the output file, 
+ * which are then sorted one by one. Concatenating the sorted buckets in the order of their keys gives the sorted points.
+ * The nodes per layer are counted while sorting.
+ */
+template<class F>
+void stream_points(const arguments &arg, layer_counter &counter, streamed_points &points, const char * source, F read) {
+  const uint32_t MAX_BUCKETS = 256;
+  const uint32_t SPILL_BUFFER = 1<<14;
+  uint64_t capacity = std::max<uint64_t>(arg.memory / SORT_MEMORY, 1<<16);
+  printf("[%10.0f] Reading points from %s.\n", t.elapsed(), source);
+  points.memory.resize(capacity);
+  uint64_t n = read(points.memory.data(), capacity);
+  if (n < capacity) {
+    printf("[%10.0f] Sorting %lu points in memory.\n", t.elapsed(), n);
+    points.memory.resize(n);
+    points.memory.resize(radix_sort_points(points.memory.data(), n, counter, arg.density));
+    points.sorted.add(points.memory.data(), points.memory.size());
+    return;
+  }
+  
+  // Choose the bucket size, such that the points read so far are spread over at most MAX_BUCKETS buckets.
+  std::vector<uint64_t> sample;
+  for (uint64_t i=0; i<n; i+=64) {
+    sample.push_back(hilbert3d(points.memory[i]));
+  }
+  std::sort(sample.begin(), sample.end());
+  int level = 20;
+  while (level > 0) {
+    uint32_t buckets = 1;
+    for (uint64_t i=1; i<sample.size() && buckets <= MAX_BUCKETS; i++) {
+      if ((sample[i] >> 3*(level-1)) != (sample[i-1] >> 3*(level-1))) buckets++;
+    }
+    if (buckets > MAX_BUCKETS) break;
+    level--;
+  }
+  printf("[%10.0f] Spilling points into buckets of 2^%d voxels wide.\n", t.elapsed(), level);
+  
+  std::map<uint64_t, spill_bucket> buckets;
+  uint64_t total = 0;
+  while (n > 0) {
+    total += n;
+    printf("[%10.0f] Read %lu points.\n", t.elapsed(), total);
+    for (uint64_t i=0; i<n; i++) {
+      const point &p = points.memory[i];
+      spill_bucket &b = buckets[hilbert3d(p) >> 3*level];
+      if (b.fd == -1) {
+        char filename[4096];
+        snprintf(filename, sizeof(filename), "%s.bucket%lu", arg.outfile, points.filenames.size());
+        b.files.push_back(filename);
+        b.fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (b.fd == -1) {perror("Could not create spill file"); exit(1);}
+        points.filenames.push_back(filename);
+      }
+      b.buffer.push_back(p);
+      b.count++;
+      if (b.buffer.size() >= SPILL_BUFFER) b.flush();
+      if (buckets.size() > MAX_BUCKETS) {
+        // The points cover a larger area than expected, merge the buckets into larger ones.
+        level++;
+        std::map<uint64_t, spill_bucket> merged;
+        for (auto &entry : buckets) {
+          entry.second.close();
+          spill_bucket &m = merged[entry.first >> 3];
+          m.files.insert(m.files.end(), entry.second.files.begin(), entry.second.files.end());
+          m.count += entry.second.count;
+        }
+        buckets.swap(merged);
+        printf("[%10.0f] Merged buckets, which are now 2^%d voxels wide.\n", t.elapsed(), level);
+      }
+    }
+    n = read(points.memory.data(), capacity);
+  }
+  std::vector<point>().swap(points.memory);
+  
+  // Sort the buckets in the order of their keys and count their nodes.
+  uint64_t index = 0;
+  uint64_t old = ~0ull;
+  for (auto &entry : buckets) {
+    spill_bucket &b = entry.second;
+    b.close();
+    const char * filename = b.files[0].c_str();
+    if (b.files.size() > 1) {
+      // Concatenate the files of merged buckets.
+      int fd = open(filename, O_WRONLY | O_APPEND);
+      if (fd == -1) {perror("Could not open spill file"); exit(1);}
+      for (uint32_t i=1; i<b.files.size(); i++) {
+        pointwindow part(b.files[i].c_str());
+        do {
+          uint64_t bytes = (part.end - part.begin) * sizeof(point);
+          for (uint64_t done=0; done<bytes; ) {
+            ssize_t r = write(fd, (char*)part.list + done, bytes - done);
+            if (r <= 0) {perror("Could not write to spill file"); exit(1);}
+            done += r;
+          }
+        } while (part.next());
+        unlink(b.files[i].c_str());
+      }
+      close(fd);
+    }
+    printf("[%10.0f] Sorting bucket %lu of %lu (%lu points).\n", t.elapsed(), points.buckets.size() + 1, buckets.size(), b.count);
+    layer_counter c(index, old);
+    if (b.count * SORT_MEMORY <= arg.memory) {
+      pointset in(filename, true);
+      in.enable_write(true);
+      uint64_t length = radix_sort_points(in.list, in.length, c, arg.density);
+      in.enable_write(false);
+      in.truncate(length);
+    } else {
+      external_sort_points(filename, filename, arg.memory, c, arg.density);
+    }
+    counter.append(c);
+    old = c.old;
+    index = c.index;
+    pointset * sorted = new pointset(filename);
+    points.buckets.push_back(sorted);
+    points.sorted.add(sorted->list, sorted->length);
+  }
+}
+
+/** Reads the points from a file that is decoded in parallel and sorts them.
+ * The points are decoded into the stream buffer with decode(begin, count, list).
+ */
+template<class F>
+void stream_decoded(const arguments &arg, layer_counter &counter, streamed_points &points, uint64_t length, F decode) {
+  uint64_t next = 0;
+  stream_points(arg, counter, points, arg.infile, [&](point * list, uint64_t count) {
+    count = std::min(count, length - next);
+    parallel_ranges(count, [&](int, uint64_t begin, uint64_t end) {
+      decode(next + begin, end - begin, list + begin);
+    });
+    next += count;
+    return count;
+  });
 }
 
 /** Stores the number of nodes per layer and some additional information.
@@ -266,33 +930,19 @@ struct layer_info {
   int top_repeat_layer;
   int top_data_layer;
   int bottom_layer;
+  uint32_t min[3]; //< Bounding box of the points.
+  uint32_t max[3];
 };
 
-layer_info count_nodes_per_layer(const arguments &arg, const pointset &in) {
+layer_info count_nodes_per_layer(const arguments &arg, const layer_counter &counter) {
   layer_info r;
-  // Count nodes per layer
+  // The nodes per layer have been counted while sorting.
   // Used to determine file structure and size.
   // Layers are counted as well.
-  printf("[%10.0f] Counting nodes per layer.\n", t.elapsed());
-  int64_t maxnode=0;
-  for (int j=0; j<D; j++) r.nodecount[j]=0;
-  int64_t old = -1;
-  for (uint64_t i=0; i<in.length; i++) {
-    if (i && (i&0x3fffff)==0) {
-      printf("[%10.0f] Counting ... %6.2f%%.\n", t.elapsed(), i*100.0/in.length);
-    }
-    point q = in.list[i];
-    assert(q.c<0x1000000);    
-    int64_t cur = morton3d(q.x, q.y, q.z);
-    for (int j=0; j<D; j++) {
-      if ((cur>>j*3)!=(old>>j*3)) {
-        r.nodecount[j]++;
-      }
-    }
-    old = cur;
-    if (maxnode<cur)
-      maxnode=cur;
-  }
+  std::copy(counter.nodecount, counter.nodecount + D, r.nodecount);
+  std::copy(counter.min, counter.min + 3, r.min);
+  std::copy(counter.max, counter.max + 3, r.max);
+  uint64_t maxnode = counter.max_key;
   
   // Determine top layer
   printf("[%10.0f] Counting layers (maxnode=0x%lx).\n", t.elapsed(), maxnode);
@@ -306,8 +956,16 @@ layer_info count_nodes_per_layer(const arguments &arg, const pointset &in) {
   // Determine lower layer prunning. Nodes should have at least 2 childnodes on average.
   printf("[%10.0f] Determine lower layer pruning.\n", t.elapsed());
   r.bottom_layer=0;
-  assert(r.nodecount[r.bottom_layer]>1);
-  while(r.nodecount[r.bottom_layer]<r.nodecount[r.bottom_layer+1]*2) r.bottom_layer++;
+  if (arg.leaf_layer >= 0) {
+    if (arg.leaf_layer >= r.top_data_layer) {
+      fprintf(stderr, "The leaf layer must be below the top layer, which is %d.\n", r.top_data_layer);
+      exit(1);
+    }
+    r.bottom_layer = arg.leaf_layer;
+  } else {
+    assert(r.nodecount[r.bottom_layer]>1);
+    while(r.nodecount[r.bottom_layer]<r.nodecount[r.bottom_layer+1]*2) r.bottom_layer++;
+  }
   printf("[%10.0f] Lowest %d layers will be pruned.\n", t.elapsed(), r.bottom_layer);
     
   // Report on node counts per layer and determine file size.
@@ -330,8 +988,8 @@ layer_info count_nodes_per_layer(const arguments &arg, const pointset &in) {
  * and describe the position in the octree node array.
  */
 struct file_info {
-  uint32_t layer_start[D];
-  uint32_t layer_end[D];
+  uint64_t layer_start[D]; //< 64 bit, such that the size of octrees that are too large is still computed correctly.
+  uint64_t layer_end[D];
   uint64_t filesize;
 };
 
@@ -359,10 +1017,109 @@ file_info compute_file_structure(const layer_info &layers) {
   return r;
 }
 
-void write_points(octree* root, const pointset &in, const layer_info &layers, const file_info &file) {
+/** Returns the lowest leaf layer, not below the leaf layer of the given layers, for which the node array 
+ * takes at most the given number of bytes. If there is no such layer, the layer below the top is returned.
+ */
+int leaf_layer_for_size(const layer_info &layers, uint64_t bytes) {
+  layer_info r = layers;
+  while (r.bottom_layer + 1 < r.top_data_layer && compute_file_structure(r).filesize > bytes) r.bottom_layer++;
+  if (compute_file_structure(r).filesize > bytes) {
+    human_filesize size(compute_file_structure(r).filesize);
+    printf("[%10.0f] Cannot reduce the octree below %lu%sB.\n", t.elapsed(), size.number, size.suffix);
+  }
+  return r.bottom_layer;
+}
+
+/** Collapses the lowest layers into leaves, as required by -max-depth and -max-bytes. 
+ * As the number of nodes per layer is known, the size of the octree is known for every leaf layer.
+ */
+void limit_leaf_layer(const arguments &arg, layer_info &layers) {
+  int bottom = layers.bottom_layer;
+  if (arg.max_depth) {
+    layers.bottom_layer = std::max(layers.bottom_layer, layers.top_data_layer - arg.max_depth);
+  }
+  if (arg.max_bytes) {
+    layers.bottom_layer = leaf_layer_for_size(layers, arg.max_bytes);
+  }
+  if (layers.bottom_layer > bottom) {
+    printf("[%10.0f] Lowest %d layers will be pruned to limit the size of the octree.\n", t.elapsed(), layers.bottom_layer);
+  }
+}
+
+/** Returns the sum of the colors of the points from begin to end. If the points store their density, 
+ * which is the number of points that were collapsed into it minus one, each point is weighted by it.
+ */
+static color_sum sum_colors(const sorted_points &in, uint64_t begin, uint64_t end, bool density) {
+  color_sum sum;
+  for (uint64_t i=begin; i<end; i++) {
+    uint32_t c = in[i].c;
+    sum.add(c, density ? (c >> 24) + 1 : 1);
+  }
+  return sum;
+}
+
+/** Returns the index after the last point, before end, that is stored in the same leaf as point i.
+ * As the hilbert curve visits all voxels of a node before leaving it, the points of a leaf are consecutive.
+ */
+static uint64_t leaf_end(const sorted_points &in, uint64_t i, uint64_t end, int bottom_layer) {
+  const point &p = in[i];
+  uint64_t leaf = morton3d(p.z, p.y, p.x) >> bottom_layer*3;
+  for (i++; i<end; i++) {
+    const point &q = in[i];
+    if ((morton3d(q.z, q.y, q.x) >> bottom_layer*3) != leaf) break;
+  }
+  return i;
+}
+
+/** Inserts a point into the octree, starting at the node cur in layer top and creating nodes down to layer stop.
+ * If stop is the bottom layer, the point is stored as a leaf. New nodes and leaves are allocated at 
+ * location[layer], which is advanced accordingly. Returns the node in layer stop, or in the layer above the leaves.
+ */
+static octree * insert_point(octree * root, octree * cur, uint64_t val, uint32_t color, int top, int stop, 
+                             const layer_info &layers, const file_info &file, uint32_t * location) {
+  (void)file; // Only used by assertions.
+  for (int depth = top-1; depth >= stop; depth--) {
+    // Extract the child index for the current layer based from the morton code.
+    uint32_t index = (val >> depth*3)&7;
+    uint32_t pos = cur->insert_index(index);
+    //printf("depth=%d, index=%d, pos=%d, location[depth]=%u, cur=%ld.\n", depth, index, pos, location[depth+1], cur-root);
+    
+    if (depth <= layers.bottom_layer) {
+      if (cur->child[pos] == 0) {
+        assert(location[depth+1]<file.layer_end[depth+1]);
+        location[depth+1]++; // Create entry in this layer
+      }
+      // Bottom layer stores child colors instead of child pointers.
+      cur->set_color(pos, color);
+
+    } else {
+      // Check if we need to create a new node.
+      if (cur->child[pos] == 0) {
+        // Is there still sufficient bytes left?
+        assert(location[depth+1]<file.layer_end[depth+1]);
+        assert(location[depth]<file.layer_end[depth]);
+        // Get location for new node.
+        uint32_t next = location[depth];
+        // Assign bytes to the new node.
+        location[depth+1]++; // Create entry in this layer
+        location[depth]++; // Create node in lower layer
+        // Initialize new node.
+        //printf("Created node %d\n", next);
+        root[next].bitmask = 0;
+        root[next].avgcolor = 0xeeeeee;
+        cur->child[pos] = next;
+      }
+      assert(cur->child[pos]<file.layer_end[depth]);
+      cur = &root[cur->child[pos]];
+    }
+  }
+  return cur;
+}
+
+void write_points(octree* root, const sorted_points &in, const layer_info &layers, const file_info &file, 
+                  const std::vector<checkpoint> &checkpoints, bool density) {
   // Read voxels and store them.
   printf("[%10.0f] Storing points.\n", t.elapsed());
-  uint64_t bytes_written = 0;
   uint32_t location[D]; //< Writing location for data of each layer.
   for (uint32_t i=0; i<D; i++) {
     location[i] = file.layer_start[i];
@@ -371,88 +1128,934 @@ void write_points(octree* root, const pointset &in, const layer_info &layers, co
   root[0].bitmask = 0;
   root[0].avgcolor = 0xeeeeee;
   location[layers.top_repeat_layer]++;
-  bytes_written += 4;
-  // Process file.
-  for (uint32_t i=0; i<in.length; i++) {
-    // Periodically print some progress info every 4MiPoints.
-    if (i && (i&0x3fffff)==0) {
-      human_filesize bytes(bytes_written);
-      printf("[%10.0f] Stored %6.2f%% points (%lu%sB).\n", t.elapsed(), i*100.0/in.length, bytes.number, bytes.suffix);
-    }
-    // Proces the next point.
-    point p(in.list[i]);
-    uint64_t val = morton3d(p.z, p.y, p.x);
-    octree * cur = root;
-    //printf("val=%15lx, p{x=%d,y=%d,z=%d,c=%6x}.\n", val, p.x, p.y, p.z, p.c);
-    for (int depth = layers.top_repeat_layer-1; depth >= layers.bottom_layer; depth--) {
-      // Extract the child index for the current layer based from the morton code.
-      uint32_t index = (val >> depth*3)&7;
-      uint32_t pos = cur->insert_index(index);
-      //printf("i=%u, depth=%d, index=%d, pos=%d, location[depth]=%u, cur=%ld.\n", i, depth, index, pos, location[depth+1], cur-root);
-      
-      if (depth <= layers.bottom_layer) {
-        if (cur->child[pos] == 0) {
-          assert(location[depth+1]<file.layer_end[depth+1]);
-          location[depth+1]++; // Create entry in this layer
-          bytes_written += 4;
+  
+  if (layers.top_data_layer - 1 <= layers.bottom_layer) {
+    // There are no intermediate layers in which the tree can be split.
+    for (uint64_t i=0; i<in.length; ) {
+      // Points that are collapsed into the same leaf get their average color.
+      point p(in[i]);
+      uint64_t next = leaf_end(in, i, in.length, layers.bottom_layer);
+      uint32_t color = sum_colors(in, i, next, density).color();
+      insert_point(root, root, morton3d(p.z, p.y, p.x), color, layers.top_repeat_layer, layers.bottom_layer, layers, file, location);
+      i = next;
+    }
+    return;
+  }
+  
+  // Split the points at the checkpoints that start a node in the split layer. The nodes in and below that layer
+  // are created in parallel. The split layer is chosen such that most checkpoint intervals contain the start of a node.
+  int split = layers.bottom_layer + 1;
+  while (split + 1 < layers.top_data_layer && layers.nodecount[split + 1] >= in.length / layer_counter::CHECKPOINT_INTERVAL) split++;
+  std::vector<const checkpoint*> pieces;
+  for (const checkpoint &c : checkpoints) {
+    if (c.level >= split) pieces.push_back(&c);
+  }
+  assert(!pieces.empty() && pieces[0]->index == 0);
+  printf("[%10.0f] Storing points in %lu parts, split at layer %d.\n", t.elapsed(), pieces.size(), split);
+  
+  // The nodes in the split layer, with the index of their first point, which are linked to the tree afterwards.
+  typedef std::pair<uint64_t, uint32_t> split_node;
+  std::vector<std::vector<split_node>> split_nodes(pieces.size());
+  parallel_ranges(in.length, [&](int thread, uint64_t begin, uint64_t end) {
+    auto first = std::lower_bound(pieces.begin(), pieces.end(), begin, [](const checkpoint * c, uint64_t i){return c->index < i;});
+    auto last  = std::lower_bound(pieces.begin(), pieces.end(), end,   [](const checkpoint * c, uint64_t i){return c->index < i;});
+    for (auto c = first; c != last; ++c) {
+      uint64_t c_end = (c+1 == pieces.end()) ? in.length : (*(c+1))->index;
+      // As the points are sorted, the nodes of each piece are contiguous within each layer.
+      // Hence the number of preceding nodes gives the location of the piece in each layer,
+      // which results in the same file as inserting the points one by one.
+      uint32_t location[D];
+      for (int i=layers.bottom_layer+1; i<=split; i++) {
+        // Every node in layer i and every child of these nodes takes one entry.
+        location[i] = file.layer_start[i] + (*c)->nodecount[i] + (*c)->nodecount[i-1];
+      }
+      std::vector<split_node> &nodes = split_nodes[c - pieces.begin()];
+      octree * cur = nullptr;
+      uint64_t old = ~0ull;
+      for (uint64_t i=(*c)->index; i<c_end; ) {
+        point p(in[i]);
+        uint64_t val = morton3d(p.z, p.y, p.x);
+        // Points that are collapsed into the same leaf get their average color.
+        uint64_t next = leaf_end(in, i, c_end, layers.bottom_layer);
+        uint32_t color = sum_colors(in, i, next, density).color();
+        // Periodically print some progress info every 4MiPoints.
+        if (thread == 0 && (i >> 22) != (next >> 22)) {
+          printf("[%10.0f] Stored %6.2f%% points.\n", t.elapsed(), next*100.0/end);
         }
-        // Bottom layer stores child colors instead of child pointers.
-        cur->set_color(pos, p.c);
-        //printf("Created leaf (%ldB)\n", bytes_written);
-      } else {
-        // Check if we need to create a new node.
-        if (cur->child[pos] == 0) {
-          // Is there still sufficient bytes left?
-          assert(location[depth+1]<file.layer_end[depth+1]);
-          assert(location[depth]<file.layer_end[depth]);
-          assert(bytes_written<file.filesize);
-          // Get location for new node.
-          uint32_t next = location[depth];
-          // Assign bytes to the new node.
-          location[depth+1]++; // Create entry in this layer
-          location[depth]++; // Create node in lower layer
-          bytes_written += 8;
-          // Initialize new node.
-          //printf("Created node %d (%ldB)\n", next, bytes_written);
+        if ((val >> split*3) != (old >> split*3)) {
+          // Create the next node in the split layer.
+          uint32_t next = location[split]++;
           root[next].bitmask = 0;
           root[next].avgcolor = 0xeeeeee;
-          cur->child[pos] = next;
+          nodes.push_back(split_node(i, next));
+          cur = &root[next];
         }
-        assert(cur->child[pos]<file.layer_end[depth]);
-        cur = &root[cur->child[pos]];
+        insert_point(root, cur, val, color, split, layers.bottom_layer, layers, file, location);
+        old = val;
+        i = next;
       }
     }
+  });
+  
+  // Create the layers above the split layer and link the nodes in the split layer to them.
+  for (const std::vector<split_node> &nodes : split_nodes) {
+    for (const split_node &n : nodes) {
+      point p(in[n.first]);
+      uint64_t val = morton3d(p.z, p.y, p.x);
+      octree * parent = insert_point(root, root, val, p.c, layers.top_repeat_layer, split+1, layers, file, location);
+      uint32_t pos = parent->insert_index((val >> split*3)&7);
+      assert(parent->child[pos] == 0);
+      location[split+1]++; // Create entry in the parent layer
+      parent->child[pos] = n.second;
+    }
   }
 }
 
-int main(int argc, char ** argv){ 
-  arguments arg = parse_arguments(argc, argv);
+/** Merges sorted points and existing octrees, which must be stored as created by write_points,
+ * without bricks, split colors or a palette. The octrees are aligned at the origin, hence octrees 
+ * built from points in adjacent cubes combine into one model. The merged octree is stored in the same layout. 
+ * Nodes that occur in more than one source, or that cross the boundary of the crop box, are rebuilt 
+ * and their average colors are recomputed. Other subtrees are copied, with their pointers relocated. 
+ * As the layers are stored in order, such a subtree occupies a contiguous range of every layer, 
+ * which is found without visiting its nodes. 
+ * 
+ * Leaves take the color of the new points if any, otherwise that of the last octree that contains them.
+ * If the leaf layer is above the leaf layer of an octree, its nodes in the leaf layer become leaves.
+ * Leaves are kept if their lowest corner is inside the crop box.
+ */
+struct octree_merge {
+  static const uint32_t NONE = ~0u;
+  std::vector<octree_file*> trees;
+  int old_top;   //< Highest top layer of the existing octrees.
+  int bottom;    //< Leaf layer of the merged octree.
+  uint32_t box_min[3]; //< Crop box, inclusive.
+  uint32_t box_max[3];
+  const sorted_points &in;
+  bool density;               //< Whether the points store their density.
+  std::vector<uint64_t> keys; //< Hilbert keys of the points.
+  uint64_t nodecount[D];      //< Number of nodes per layer of the merged octree.
+  /** For each layer, the nodes of the children of the node that is being merged in that layer, 
+   * for each child and each octree. */
+  std::vector<uint32_t> refs;
+  /** The bitmasks of the rebuilt nodes, in the order in which they are written. 
+   * These are determined while counting, as children can turn out to be empty after cropping. */
+  std::vector<uint8_t> masks;
+  uint64_t cursor;
+  
+  octree_merge(const arguments &arg, const sorted_points &in) : old_top(0), bottom(arg.leaf_layer), in(in), density(arg.density), keys(in.length), cursor(0) {
+    for (const char * filename : arg.merge) {
+      octree_file * tree = new octree_file(filename);
+      const octree_header &h = tree->header;
+      if (!(h.flags & OCTREE_LAYERED) || h.top_repeat_layer != h.top_data_layer) {
+        fprintf(stderr, "Octree file '%s' cannot be merged, as it is not created by build_db or it is repeated.\n", filename);
+        exit(1);
+      }
+      if (h.flags & OCTREE_SHARED) {
+        fprintf(stderr, "Octree file '%s' cannot be merged, as its subtrees are shared.\n", filename);
+        exit(1);
+      }
+      if (h.flags & (OCTREE_BRICKS | OCTREE_SPLIT_COLORS | OCTREE_PALETTE)) {
+        fprintf(stderr, "Octree file '%s' cannot be merged, as it uses bricks, split colors or a palette.\n", filename);
+        exit(1);
+      }
+      if (arg.leaf_layer >= 0 ? h.bottom_layer > arg.leaf_layer : bottom >= 0 && h.bottom_layer != bottom) {
+        fprintf(stderr, "Octree file '%s' has its leaves in layer %d, use -leaf-layer to choose a common leaf layer.\n", filename, h.bottom_layer);
+        exit(1);
+      }
+      old_top = std::max(old_top, h.top_data_layer);
+      if (arg.leaf_layer < 0) bottom = h.bottom_layer;
+      trees.push_back(tree);
+    }
+    std::copy(arg.crop_min, arg.crop_min + 3, box_min);
+    std::copy(arg.crop_max, arg.crop_max + 3, box_max);
+    std::fill(nodecount, nodecount + D, 0);
+    refs.resize((D+1) * 8 * trees.size());
+    parallel_ranges(in.length, [&](int, uint64_t begin, uint64_t end) {
+      for (uint64_t i=begin; i<end; i++) {
+        keys[i] = hilbert3d(in[i]);
+      }
+    });
+  }
+  ~octree_merge() {
+    for (octree_file * tree : trees) delete tree;
+  }
+  
+  /** Returns whether the cube of the given size with its lowest corner at (x,y,z) is inside the crop box. */
+  bool inside(uint32_t x, uint32_t y, uint32_t z, uint64_t size) const {
+    return x >= box_min[0] && x + size - 1 <= box_max[0] && 
+           y >= box_min[1] && y + size - 1 <= box_max[1] && 
+           z >= box_min[2] && z + size - 1 <= box_max[2];
+  }
+  
+  /** Returns whether the given child of a node in the given layer is kept after cropping. */
+  bool keep(int layer, uint32_t x, uint32_t y, uint32_t z) const {
+    if (layer == bottom) return inside(x, y, z, 1);
+    uint64_t size = 1ull << layer;
+    return x <= box_max[0] && x + size - 1 >= box_min[0] && 
+           y <= box_max[1] && y + size - 1 >= box_min[1] && 
+           z <= box_max[2] && z + size - 1 >= box_min[2];
+  }
+  
+  /** Returns the child array entry of a node of the given octree for the given index, or NONE.
+   * Above the top of the octree, node 0 stands for the nodes on the path to its root. 
+   */
+  uint32_t child(uint32_t s, uint32_t node, int layer, int index) const {
+    if (node == NONE) return NONE;
+    if (layer > trees[s]->header.top_data_layer) return index == 0 ? 0 : NONE;
+    const octree &n = trees[s]->root[node];
+    return n.has_index(index) ? n.child[n.position(index)] : NONE;
+  }
+  
+  /** Looks up the children of the given nodes of each octree, which are stored in refs for the given layer.
+   * Returns the bitmask of the children that exist in any of the octrees.
+   */
+  uint32_t children(const uint32_t * nodes, int layer) {
+    uint32_t k = trees.size();
+    uint32_t * c = &refs[layer * 8 * k];
+    uint32_t bitmask = 0;
+    for (int i=0; i<8; i++) {
+      for (uint32_t s=0; s<k; s++) {
+        c[i*k+s] = child(s, nodes[s], layer, i);
+        if (c[i*k+s] != NONE) bitmask |= 1<<i;
+      }
+    }
+    return bitmask;
+  }
+  
+  /** Returns the octree that is the only one containing the given node and is not above its top, 
+   * such that the subtree can be copied. Otherwise returns -1.
+   */
+  int single(const uint32_t * nodes, int layer) const {
+    int r = -1;
+    for (uint32_t s=0; s<trees.size(); s++) {
+      if (nodes[s] == NONE) continue;
+      if (r >= 0 || layer > trees[s]->header.top_data_layer) return -1;
+      r = s;
+    }
+    return r;
+  }
+  
+  /** Computes the order in which the children of the node in the given layer with its lowest corner 
+   * at (x,y,z) are created, which is the hilbert order as in write_points. */
+  static void child_order(int layer, uint32_t x, uint32_t y, uint32_t z, int * order) {
+    uint32_t size = 1u << (layer-1);
+    for (int i=0; i<8; i++) {
+      if (layer - 1 < 20) {
+        point corner(x + (i>>2&1)*size, y + (i>>1&1)*size, z + (i&1)*size, 0);
+        order[hilbert3d(corner) >> 3*(layer-1) & 7] = i;
+      } else {
+        order[i] = i;
+      }
+    }
+  }
+  
+  /** Splits the points [b,e) of a node in the given layer into the ranges [begin[i], end[i]) of its children.
+   * As the points are sorted along the hilbert curve, the points of each child are contiguous.
+   * Returns the bitmask of the children that contain points.
+   */
+  uint32_t partition(int layer, uint64_t b, uint64_t e, uint64_t * begin, uint64_t * end) const {
+    std::fill(begin, begin + 8, 0);
+    std::fill(end, end + 8, 0);
+    uint32_t bitmask = 0;
+    int shift = 3*(layer-1);
+    while (b < e) {
+      uint64_t next = ((keys[b] >> shift) + 1) << shift;
+      uint64_t stop = std::lower_bound(keys.begin() + b, keys.begin() + e, next) - keys.begin();
+      const point &p = in[b];
+      int index = (morton3d(p.z, p.y, p.x) >> shift) & 7;
+      begin[index] = b;
+      end[index] = stop;
+      bitmask |= 1<<index;
+      b = stop;
+    }
+    return bitmask;
+  }
+  
+  /** Computes the range of the subtree of a node of the given octree in each layer from its layer 
+   * down to the layer above the leaves, and the number of nodes in each of these ranges. 
+   * The range in the next layer starts at the first child of the first node and ends with the last child
+   * of the last node. As children are created in hilbert order, these are the lowest and highest pointers.
+   */
+  void extent(uint32_t s, uint32_t node, int layer, uint32_t * start, uint32_t * end, uint64_t * nodes) const {
+    const octree * old = trees[s]->root;
+    uint32_t first = node;
+    uint32_t last = node;
+    start[layer] = node;
+    end[layer] = node + 1 + old[node].size();
+    nodes[layer] = 1;
+    for (int j=layer; j>bottom+1; j--) {
+      first = *std::min_element(old[first].child, old[first].child + old[first].size());
+      last  = *std::max_element(old[last].child,  old[last].child  + old[last].size());
+      start[j-1] = first;
+      end[j-1] = last + 1 + old[last].size();
+      // Every entry in layer j points to a node in layer j-1.
+      nodes[j-1] = end[j] - start[j] - nodes[j];
+    }
+  }
+  
+  /** Counts the nodes of the merged subtree of the given nodes, which has its lowest corner at (x,y,z).
+   * Returns false if the subtree is empty. 
+   */
+  bool count(const uint32_t * nodes, int layer, uint64_t b, uint64_t e, uint32_t x, uint32_t y, uint32_t z) {
+    int s = single(nodes, layer);
+    if (b == e && s >= 0 && inside(x, y, z, 1ull << layer)) {
+      uint32_t start[D], end[D];
+      uint64_t counts[D];
+      extent(s, nodes[s], layer, start, end, counts);
+      for (int j=layer; j>bottom; j--) nodecount[j] += counts[j];
+      nodecount[bottom] += end[bottom+1] - start[bottom+1] - counts[bottom+1];
+      return true;
+    }
+    uint64_t begin[8], end[8];
+    uint32_t bitmask = partition(layer, b, e, begin, end) | children(nodes, layer);
+    int order[8];
+    child_order(layer, x, y, z, order);
+    uint64_t mask = masks.size();
+    masks.push_back(0);
+    uint32_t size = 1u << (layer-1);
+    for (int k=0; k<8; k++) {
+      int i = order[k];
+      uint32_t cx = x + (i>>2&1)*size, cy = y + (i>>1&1)*size, cz = z + (i&1)*size;
+      if (!(bitmask & (1<<i)) || !keep(layer-1, cx, cy, cz)) continue;
+      if (layer - 1 == bottom) {
+        nodecount[bottom]++;
+        masks[mask] |= 1<<i;
+      } else {
+        uint64_t n = masks.size();
+        if (count(&refs[(layer * 8 + i) * trees.size()], layer-1, begin[i], end[i], cx, cy, cz)) {
+          masks[mask] |= 1<<i;
+        } else {
+          masks.resize(n);
+        }
+      }
+    }
+    if (masks[mask]) nodecount[layer]++;
+    return masks[mask] != 0;
+  }
+  
+  /** Determines the layers of the merged octree. The top layer is raised if the new points do not fit in the existing octrees.
+   */
+  layer_info count_layers(const arguments &arg, const layer_counter &counter) {
+    layer_info r;
+    r.bottom_layer = bottom;
+    r.top_data_layer = std::max(old_top, bottom + 1);
+    while(counter.max_key>>r.top_data_layer*3) r.top_data_layer++;
+    r.top_repeat_layer = r.top_data_layer + arg.repeat_depth;
+    assert(r.top_repeat_layer <= D);
+    printf("[%10.0f] Merging %lu points and %lu octrees, resulting in %d layers.\n", t.elapsed(), in.length, trees.size(), r.top_data_layer - bottom);
+    std::vector<uint32_t> root(trees.size(), 0);
+    if (!count(root.data(), r.top_repeat_layer, 0, in.length, 0, 0, 0)) {
+      fprintf(stderr, "The merged octree is empty.\n");
+      exit(1);
+    }
+    std::copy(nodecount, nodecount + D, r.nodecount);
+    for (int i=bottom; i<=r.top_repeat_layer; i++) {
+      printf("[%10.0f] At layer %2d: %8lu %s.\n", t.elapsed(), i, r.nodecount[i], i==bottom?"leaves":"nodes");
+    }
+    // The bounding box is unknown if it is unknown for any of the existing octrees.
+    std::copy(counter.min, counter.min + 3, r.min);
+    std::copy(counter.max, counter.max + 3, r.max);
+    for (octree_file * tree : trees) {
+      const octree_header &h = tree->header;
+      for (int j=0; j<3; j++) {
+        r.min[j] = h.has_bounds() ? std::min(r.min[j], h.bounds_min[j]) : ~0u;
+        r.max[j] = h.has_bounds() ? std::max(r.max[j], h.bounds_max[j]) : 0;
+      }
+      if (!h.has_bounds()) break;
+    }
+    if (r.min[0] <= r.max[0]) {
+      for (int j=0; j<3; j++) {
+        r.min[j] = std::max(r.min[j], box_min[j]);
+        r.max[j] = std::min(r.max[j], box_max[j]);
+      }
+    }
+    return r;
+  }
+  
+  /** Copies the subtree of a node of the given octree to location[j] in each layer j. 
+   * Returns the color sum of its leaves, which is derived from the average color of the node. 
+   */
+  color_sum copy(octree * root, uint32_t * location, uint32_t s, uint32_t node, int layer) {
+    const octree * old = trees[s]->root;
+    uint32_t start[D], end[D];
+    uint64_t nodes[D];
+    extent(s, node, layer, start, end, nodes);
+    for (int j=layer; j>bottom; j--) {
+      uint32_t target = location[j];
+      uint32_t length = end[j] - start[j];
+      memcpy(root + target, old + start[j], length * sizeof(octree));
+      if (j-1 > bottom && location[j-1] != start[j-1]) {
+        uint32_t delta = location[j-1] - start[j-1];
+        for (uint32_t k=target; k<target+length; k+=1+root[k].size()) {
+          for (uint32_t c=0; c<root[k].size(); c++) {
+            root[k].child[c] += delta;
+          }
+        }
+      } else if (j-1 == bottom && trees[s]->header.bottom_layer < bottom) {
+        // The nodes in the leaf layer are replaced by leaves.
+        for (uint32_t k=target; k<target+length; k+=1+root[k].size()) {
+          for (uint32_t c=0; c<root[k].size(); c++) {
+            root[k].set_color(c, old[root[k].child[c]].avgcolor);
+          }
+        }
+      }
+      location[j] += length;
+    }
+    uint64_t leaves = end[bottom+1] - start[bottom+1] - nodes[bottom+1];
+    color_sum sum(old[node].avgcolor);
+    sum.r *= leaves;
+    sum.g *= leaves;
+    sum.b *= leaves;
+    sum.n = leaves;
+    return sum;
+  }
+  
+  /** Writes the merged subtree of the given nodes at location[layer] and returns the color sum of its leaves.
+   * The node has its lowest corner at (x,y,z). Its children are written in hilbert order, as in write_points.
+   */
+  color_sum write(octree * root, uint32_t * location, const uint32_t * nodes, int layer, uint64_t b, uint64_t e, uint32_t x, uint32_t y, uint32_t z) {
+    int s = single(nodes, layer);
+    if (b == e && s >= 0 && inside(x, y, z, 1ull << layer)) return copy(root, location, s, nodes[s], layer);
+    uint64_t begin[8], end[8];
+    partition(layer, b, e, begin, end);
+    children(nodes, layer);
+    int order[8];
+    child_order(layer, x, y, z, order);
+    uint32_t bitmask = masks[cursor++];
+    uint32_t index = location[layer];
+    location[layer] += 1 + popcount(bitmask);
+    root[index].bitmask = bitmask;
+    color_sum sum;
+    uint32_t size = 1u << (layer-1);
+    for (int k=0; k<8; k++) {
+      int i = order[k];
+      if (!(bitmask & (1<<i))) continue;
+      uint32_t pos = root[index].position(i);
+      const uint32_t * c = &refs[(layer * 8 + i) * trees.size()];
+      if (layer - 1 == bottom) {
+        uint32_t color = 0;
+        if (begin[i] < end[i]) {
+          color = sum_colors(in, begin[i], end[i], density).color();
+        } else {
+          for (uint32_t j=0; j<trees.size(); j++) {
+            if (c[j] == NONE) continue;
+            color = trees[j]->header.bottom_layer == bottom ? c[j] & 0xffffff : trees[j]->root[c[j]].avgcolor;
+          }
+        }
+        root[index].set_color(pos, color);
+        sum += color_sum(color);
+      } else {
+        root[index].child[pos] = location[layer-1];
+        sum += write(root, location, c, layer-1, begin[i], end[i], x + (i>>2&1)*size, y + (i>>1&1)*size, z + (i&1)*size);
+      }
+    }
+    root[index].avgcolor = sum.color();
+    return sum;
+  }
+  
+  /** Writes the merged octree, including its average colors. */
+  void write(octree * root, const layer_info &layers, const file_info &file) {
+    uint32_t location[D];
+    for (uint32_t i=0; i<D; i++) {
+      location[i] = file.layer_start[i];
+    }
+    std::vector<uint32_t> nodes(trees.size(), 0);
+    write(root, location, nodes.data(), layers.top_repeat_layer, 0, in.length, 0, 0, 0);
+    assert(cursor == masks.size());
+    for (int i=layers.bottom_layer+1; i<layers.top_data_layer; i++) {
+      assert(location[i] == file.layer_end[i]);
+    }
+  }
+};
+
+/** Writes the leaves below the given node in the given layer with its lowest corner at (x,y,z) as points. */
+static void export_node(const octree * root, uint32_t index, int layer, int bottom, uint32_t x, uint32_t y, uint32_t z, pointfile &out) {
+  const octree &node = root[index];
+  uint32_t size = 1u << (layer-1);
+  for (int i=0; i<8; i++) {
+    if (!node.has_index(i)) continue;
+    uint32_t pos = node.position(i);
+    uint32_t cx = x + (i>>2&1)*size, cy = y + (i>>1&1)*size, cz = z + (i&1)*size;
+    if (layer - 1 == bottom) {
+      out.add(point(cx, cy, cz, node.color(pos)));
+    } else {
+      export_node(root, node.child[pos], layer-1, bottom, cx, cy, cz, out);
+    }
+  }
+}
+
+/** Writes the leaves of the octree to a pointset file, with each leaf at its lowest corner. 
+ * Must be called before the colors are quantized and the model is replicated.
+ */
+void export_points(const octree * root, const layer_info &layers, const char * filename) {
+  pointfile out(filename);
+  export_node(root, 0, layers.top_repeat_layer, layers.bottom_layer, 0, 0, 0, out);
+}
+
+/** Calls f(node, index) for every node in the layers from top down to bottom, 
+ * which must be stored as created by write_points.
+ */
+template<class F>
+void for_each_node(octree * root, const file_info &file, int top, int bottom, F f) {
+  for (int i=top; i>=bottom; i--) {
+    uint32_t index = file.layer_start[i];
+    while (index < file.layer_end[i]) {
+      octree &node = root[index];
+      if (node.bitmask == 0) {
+        // Unused room in the top layers.
+        index++;
+        continue;
+      }
+      f(node, index);
+      index += 1 + node.size();
+    }
+  }
+}
+
+/** Computes the average colors of all nodes, weighted by the number of leaves below each child.
+ * The layers are processed bottom-up, with the nodes of each layer processed in parallel.
+ * Each node is computed once from the sums of its children, hence this also works if nodes are shared.
+ */
+void average(octree * root, const layer_info &layers, const file_info &file) {
+  // Color sums of the nodes in the layer below, and for each node in that layer its index in sums.
+  std::vector<color_sum> child_sums;
+  std::vector<uint32_t> child_ordinal;
+  for (int i=layers.bottom_layer+1; i<=layers.top_repeat_layer; i++) {
+    std::vector<uint32_t> nodes;
+    std::vector<uint32_t> ordinal(file.layer_end[i] - file.layer_start[i]);
+    for_each_node(root, file, i, i, [&](octree &, uint32_t index) {
+      ordinal[index - file.layer_start[i]] = nodes.size();
+      nodes.push_back(index);
+    });
+    std::vector<color_sum> sums(nodes.size());
+    parallel_ranges(nodes.size(), [&](int, uint64_t begin, uint64_t end) {
+      for (uint64_t k=begin; k<end; k++) {
+        octree &node = root[nodes[k]];
+        color_sum c;
+        for (uint32_t j=0; j<node.size(); j++) {
+          if (node.is_pointer(j)) {
+            assert(file.layer_start[i-1] <= node.child[j] && node.child[j] < file.layer_end[i-1]);
+            c += child_sums[child_ordinal[node.child[j] - file.layer_start[i-1]]];
+          } else {
+            c += color_sum(node.color(j));
+          }
+        }
+        node.avgcolor = c.color();
+        sums[k] = c;
+      }
+    });
+    child_sums.swap(sums);
+    child_ordinal.swap(ordinal);
+  }
+}
+
+/** Part of the list of colors that is being split by the median cut algorithm. */
+struct color_box {
+  uint32_t begin, end;
+  int channel; //< The channel with the largest range.
+  int range;
+};
+
+static int channel(uint32_t color, int c) {
+  return (color >> c*8) & 0xff;
+}
+
+static color_box make_box(const std::vector<uint32_t> &list, uint32_t begin, uint32_t end) {
+  color_box box = {begin, end, 0, 0};
+  for (int c=0; c<3; c++) {
+    int low = 255, high = 0;
+    for (uint32_t i=begin; i<end; i++) {
+      low = std::min(low, channel(list[i], c));
+      high = std::max(high, channel(list[i], c));
+    }
+    if (high - low > box.range) {
+      box.channel = c;
+      box.range = high - low;
+    }
+  }
+  return box;
+}
+
+/** Fits a palette of at most the given size to the histogram of colors, using the median cut algorithm.
+ * Afterwards, the histogram contains the palette index + 1 of each color that occurs.
+ */
+std::vector<uint32_t> fit_palette(std::vector<uint32_t> &histogram, uint32_t size) {
+  std::vector<uint32_t> list;
+  for (uint32_t c=0; c<histogram.size(); c++) {
+    if (histogram[c]) list.push_back(c);
+  }
+  std::vector<color_box> boxes;
+  boxes.push_back(make_box(list, 0, list.size()));
+  while (boxes.size() < size) {
+    // Split the box with the largest range at the weighted median of its widest channel.
+    uint32_t b = 0;
+    for (uint32_t i=1; i<boxes.size(); i++) {
+      if (boxes[i].range > boxes[b].range) b = i;
+    }
+    color_box box = boxes[b];
+    if (box.range == 0) break;
+    std::sort(list.begin() + box.begin, list.begin() + box.end, [&](uint32_t x, uint32_t y) {
+      return channel(x, box.channel) < channel(y, box.channel);
+    });
+    uint64_t total = 0;
+    for (uint32_t i=box.begin; i<box.end; i++) total += histogram[list[i]];
+    uint64_t sum = histogram[list[box.begin]];
+    uint32_t split = box.begin + 1;
+    while (split < box.end - 1 && sum + histogram[list[split]] <= total / 2) {
+      sum += histogram[list[split]];
+      split++;
+    }
+    boxes[b] = make_box(list, box.begin, split);
+    boxes.push_back(make_box(list, split, box.end));
+  }
+  // Use the weighted average of each box as palette color.
+  std::vector<uint32_t> palette;
+  for (uint32_t b=0; b<boxes.size(); b++) {
+    uint64_t r = 0, g = 0, bl = 0, n = 0;
+    for (uint32_t i=boxes[b].begin; i<boxes[b].end; i++) {
+      uint64_t w = histogram[list[i]];
+      r  += channel(list[i], 2) * w;
+      g  += channel(list[i], 1) * w;
+      bl += channel(list[i], 0) * w;
+      n  += w;
+    }
+    palette.push_back(rgb((double)r/n, (double)g/n, (double)bl/n));
+    for (uint32_t i=boxes[b].begin; i<boxes[b].end; i++) {
+      histogram[list[i]] = b + 1;
+    }
+  }
+  return palette;
+}
+
+/** Replaces all colors by indices into a palette of the given size, which is fitted to the leaf colors.
+ * Average colors are mapped to the nearest palette color, which is looked up at 18 bit precision.
+ * Returns the palette, which must be appended to the file using write_palette.
+ */
+std::vector<uint32_t> quantize_colors(octree_file &out, const layer_info &layers, const file_info &file, uint32_t size) {
+  std::vector<uint32_t> histogram(1<<24);
+  for_each_node(out.root, file, layers.top_repeat_layer, layers.bottom_layer+1, [&](octree &node, uint32_t) {
+    for (uint32_t j=0; j<node.size(); j++) {
+      if (!node.is_pointer(j)) {
+        uint32_t &count = histogram[node.color(j)];
+        if (count < ~0u) count++;
+      }
+    }
+  });
+  std::vector<uint32_t> palette = fit_palette(histogram, size);
+  human_filesize colors(std::count_if(histogram.begin(), histogram.end(), [](uint32_t c){return c>0;}));
+  printf("[%10.0f] Fitted %lu colors to %lu%s distinct leaf colors.\n", t.elapsed(), palette.size(), colors.number, colors.suffix);
   
-  // Map input file to memory
-  printf("[%10.0f] Opening '%s' read/write.\n", t.elapsed(), arg.infile);
-  pointset in(arg.infile, true);
+  std::vector<uint16_t> nearest(1<<18); // Palette index + 1, or 0 if not yet computed.
+  auto nearest_index = [&](uint32_t color) {
+    uint32_t key = (color >> 6 & 0x3f000) | (color >> 4 & 0xfc0) | (color >> 2 & 0x3f);
+    if (nearest[key] == 0) {
+      uint32_t best = 0, best_distance = ~0u;
+      for (uint32_t i=0; i<palette.size(); i++) {
+        uint32_t distance = 0;
+        for (int c=0; c<3; c++) {
+          int d = channel(palette[i], c) - channel(color, c);
+          distance += d*d;
+        }
+        if (distance < best_distance) {
+          best = i;
+          best_distance = distance;
+        }
+      }
+      nearest[key] = best + 1;
+    }
+    return nearest[key] - 1;
+  };
+  for_each_node(out.root, file, layers.top_repeat_layer, layers.bottom_layer+1, [&](octree &node, uint32_t) {
+    node.avgcolor = nearest_index(node.avgcolor);
+    for (uint32_t j=0; j<node.size(); j++) {
+      if (!node.is_pointer(j)) {
+        node.set_color(j, histogram[node.color(j)] - 1);
+      }
+    }
+  });
+  out.header.flags |= OCTREE_PALETTE;
+  out.header.palette_size = palette.size();
+  return palette;
+}
+
+/** Appends the palette to the file. */
+void write_palette(octree_file &out, const std::vector<uint32_t> &palette) {
+  out.header.palette_offset = out.extend(palette.size() * sizeof(uint32_t));
+  out.palette = (uint32_t*)out.at(out.header.palette_offset);
+  std::copy(palette.begin(), palette.end(), out.palette);
+}
+
+/** Writes the brick that replaces the given node and its children at the given index.
+ * Returns the index past the end of the brick.
+ */
+static uint32_t write_brick(octree * root, uint32_t index, uint32_t target, int bytes) {
+  const octree &node = root[index];
+  uint64_t occupancy = 0;
+  uint32_t colors[64];
+  for (int i=0; i<8; i++) {
+    if (!node.has_index(i)) continue;
+    const octree &cell = root[node.child[node.position(i)]];
+    for (int j=0; j<8; j++) {
+      if (!cell.has_index(j)) continue;
+      occupancy |= 1ull << (i*8+j);
+      colors[i*8+j] = cell.color(cell.position(j));
+    }
+  }
+  octree &brick = root[target];
+  brick.avgcolor = node.avgcolor;
+  brick.bitmask = 0;
+  brick.child[0] = occupancy;
+  brick.child[1] = occupancy >> 32;
+  uint8_t * packed = (uint8_t*)(brick.child + 2);
+  int n = 0;
+  for (int i=0; i<64; i++) {
+    if (occupancy & (1ull << i)) {
+      for (int j=0; j<bytes; j++) {
+        packed[n++] = colors[i] >> j*8;
+      }
+    }
+  }
+  return target + 3 + (n + 3) / 4;
+}
+
+/** Replaces the nodes in the 2 layers above the leaves by bricks, which reduces the file size
+ * and the number of nodes that must be visited during traversal.
+ * The bricks are written after the end of the node array, and then moved into place.
+ */
+void make_bricks(octree_file &out, const layer_info &layers, file_info &file) {
+  int brick_layer = layers.bottom_layer + 2;
+  if (brick_layer >= layers.top_repeat_layer) {
+    printf("[%10.0f] Not enough layers to create bricks.\n", t.elapsed());
+    return;
+  }
+  uint32_t start = file.layer_start[brick_layer];
+  uint32_t end = file.layer_end[brick_layer-1];
+  // Bricks are never larger than the node and its children they replace. 
+  out.resize(file.filesize + (end - start) * sizeof(octree));
+  octree * root = out.root;
+  int bytes = out.header.color_bytes();
+  uint32_t target = end;
+  for_each_node(root, file, brick_layer+1, brick_layer+1, [&](octree &node, uint32_t) {
+    for (uint32_t j=0; j<node.size(); j++) {
+      uint32_t brick = target;
+      target = write_brick(root, node.child[j], target, bytes);
+      node.child[j] = start + (brick - end);
+    }
+  });
+  memmove(root + start, root + end, (target - end) * sizeof(octree));
+  file.layer_end[brick_layer] = start + (target - end);
+  file.layer_start[brick_layer-1] = file.layer_end[brick_layer-1] = file.layer_end[brick_layer];
+  human_filesize size(file.filesize - file.layer_end[brick_layer] * sizeof(octree));
+  file.filesize = file.layer_end[brick_layer] * sizeof(octree);
+  out.resize(file.filesize);
+  out.header.flags |= OCTREE_BRICKS;
+  printf("[%10.0f] Bricks saved %lu%sB.\n", t.elapsed(), size.number, size.suffix);
+}
+
+/** Moves the colors of the nodes and leaves into a separate color array, which is appended to the file.
+ * The nodes are rewritten such that they only store their bitmask, the index of their color and 
+ * the pointers to their children, while the leaves are no longer stored in the node array.
+ * Hence traversal reads fewer bytes, and the color array only has an entry for each node and leaf.
+ * Must be called after the model is replicated, as this changes the size of the nodes.
+ */
+void split_colors(octree_file &out, const layer_info &layers, file_info &file) {
+  int bottom = layers.bottom_layer + 1;
+  // Compute the new location of every node and the location of its color.
+  std::vector<uint32_t> location(file.filesize / sizeof(octree));
+  uint32_t nodes = 0;
+  uint32_t colors = 0;
+  file_info split = file;
+  for (int i=layers.top_repeat_layer; i>=bottom; i--) {
+    split.layer_start[i] = nodes;
+    for_each_node(out.root, file, i, i, [&](octree &node, uint32_t index) {
+      location[index] = nodes;
+      nodes += i == bottom ? 2 : 2 + node.size();
+      colors += i == bottom ? 1 + node.size() : 1;
+    });
+    split.layer_end[i] = nodes;
+  }
+  split.filesize = (uint64_t)nodes * sizeof(octree);
   
-  hilbert_sort_points(arg, in);
+  // Build the new node array and the color array.
+  std::vector<uint32_t> words(nodes);
+  std::vector<uint32_t> color(colors);
+  uint32_t next = 0;
+  for_each_node(out.root, file, layers.top_repeat_layer, bottom, [&](octree &node, uint32_t index) {
+    uint32_t * target = words.data() + location[index];
+    bool leaves = index >= file.layer_start[bottom];
+    target[0] = node.bitmask << 24 | (leaves ? OCTREE_SPLIT_LEAVES : 0);
+    target[1] = next;
+    color[next++] = node.avgcolor;
+    for (uint32_t j=0; j<node.size(); j++) {
+      assert(node.is_pointer(j) != leaves);
+      if (leaves) {
+        color[next++] = node.color(j);
+      } else {
+        target[2+j] = location[node.child[j]];
+      }
+    }
+  });
+  assert(next == colors);
+  std::vector<uint32_t>().swap(location);
   
-  layer_info layers = count_nodes_per_layer(arg, in);
+  human_filesize size(split.filesize);
+  out.resize(split.filesize);
+  std::copy(words.begin(), words.end(), (uint32_t*)out.root);
+  file = split;
+  out.header.version = std::max<uint32_t>(out.header.version, 2);
+  out.header.flags |= OCTREE_SPLIT_COLORS;
+  out.header.color_count = colors;
+  int bytes = out.header.color_bytes();
+  out.header.color_offset = out.extend((uint64_t)colors * bytes);
+  out.colors = (uint8_t*)out.at(out.header.color_offset);
+  parallel_ranges(colors, [&](int, uint64_t begin, uint64_t end) {
+    for (uint64_t i=begin; i<end; i++) {
+      for (int j=0; j<bytes; j++) {
+        out.colors[i*bytes+j] = color[i] >> j*8;
+      }
+    }
+  });
+  printf("[%10.0f] Without leaves, the node array takes %lu%sB.\n", t.elapsed(), size.number, size.suffix);
+}
+
+/** Describes the structure of the octree in the file header.
+ */
+void write_header(octree_header &header, const arguments &arg, const layer_info &layers, const file_info &file) {
+  header.flags |= OCTREE_LAYERED;
+  header.top_repeat_layer = layers.top_repeat_layer;
+  header.top_data_layer = layers.top_data_layer;
+  header.bottom_layer = layers.bottom_layer;
+  header.repeat_mask = arg.repeat_mask;
+  header.repeat_depth = arg.repeat_depth;
+  for (int i=0; i<D; i++) {
+    header.layer_start[i] = file.layer_start[i];
+    header.layer_end[i] = file.layer_end[i];
+  }
+  for (int i=0; i<3; i++) {
+    header.bounds_min[i] = layers.min[i];
+    header.bounds_max[i] = layers.max[i];
+  }
+}
+
+/** Creates the octree file, stores the points or the merged octrees in it and applies the output options. */
+void write_octree(const arguments &arg, const char * filename, const layer_info &layers, const sorted_points &in, 
+                  const layer_counter &counter, octree_merge * merge, const char * exported) {
   file_info file = compute_file_structure(layers);
   
   // Prepare output file and map it to memory
   human_filesize size(file.filesize);
-  printf("[%10.0f] Creating octree file (%lu%sB).\n", t.elapsed(), size.number, size.suffix);
-  octree_file out(arg.outfile, file.filesize);
+  printf("[%10.0f] Creating octree file '%s' (%lu%sB).\n", t.elapsed(), filename, size.number, size.suffix);
+  if (file.filesize > OCTREE_MAX_FILESIZE) {
+    fprintf(stderr, "The octree is too large for the file format, which is limited to 4GiB of nodes. Use -max-bytes or -max-depth to reduce its size.\n");
+    exit(1);
+  }
+  octree_file out(filename, file.filesize);
+  
+  if (merge) {
+    printf("[%10.0f] Merging points into '%s'.\n", t.elapsed(), filename);
+    merge->write(out.root, layers, file);
+  } else {
+    write_points(out.root, in, layers, file, counter.checkpoints, arg.density);
+    
+    printf("[%10.0f] Computing average colors.\n", t.elapsed());
+    average(out.root, layers, file);
+  }
+  
+  if (exported) {
+    printf("[%10.0f] Exporting leaves to '%s'.\n", t.elapsed(), exported);
+    export_points(out.root, layers, exported);
+  }
   
-  write_points(out.root, in, layers, file);
+  std::vector<uint32_t> palette;
+  if (arg.palette) {
+    printf("[%10.0f] Quantizing colors.\n", t.elapsed());
+    palette = quantize_colors(out, layers, file, arg.palette);
+  }
   
-  printf("[%10.0f] Computing average colors.\n", t.elapsed());
-  average(out.root, 0);
+  if (arg.bricks) {
+    printf("[%10.0f] Creating bricks.\n", t.elapsed());
+    make_bricks(out, layers, file);
+  }
   
   printf("[%10.0f] Replicating model.\n", t.elapsed());
   replicate(out.root, 0, arg.repeat_mask, arg.repeat_depth);
+  
+  if (arg.split_colors) {
+    printf("[%10.0f] Moving colors into a separate array.\n", t.elapsed());
+    split_colors(out, layers, file);
+  }
+  
+  if (arg.palette) {
+    write_palette(out, palette);
+  }
+  
+  write_header(out.header, arg, layers, file);
+}
+
+int main(int argc, char ** argv){ 
+  arguments arg = parse_arguments(argc, argv);
+  
+  layer_counter counter;
+  streamed_points in;
+  pointset * mapped = nullptr;
+  if (arg.infile == nullptr) {
+    // Only octrees are merged.
+  } else if (strcmp(arg.infile, "-") == 0) {
+    stream_points(arg, counter, in, "standard input", read_points);
+  } else if (is_lasfile(arg.infile)) {
+    // LAS files are decoded in parallel while streaming, as they are not stored as voxels.
+    lasfile las(arg.infile, arg.resolution);
+    if (arg.depth) las.fit(arg.depth);
+    printf("[%10.0f] LAS file with point format %d, %lu points and %lu x %lu x %lu voxels.\n", t.elapsed(), 
+           las.format, las.length, las.extent(0), las.extent(1), las.extent(2));
+    if (las.extent(0) > 1<<20 || las.extent(1) > 1<<20 || las.extent(2) > 1<<20) {
+      fprintf(stderr,"The points span more than 2^20 voxels, use -resolution or -depth to choose larger voxels.\n");
+      exit(1);
+    }
+    stream_decoded(arg, counter, in, las.length, [&](uint64_t begin, uint64_t count, point * list) {
+      las.decode(begin, count, list);
+    });
+  } else if (is_plyfile(arg.infile)) {
+    // PLY files have real coordinates, which are quantized to the bounding box in a first pass.
+    plyfile ply(arg.infile);
+    printf("[%10.0f] PLY file with %lu vertices%s, computing bounding box.\n", t.elapsed(), ply.length, ply.has_color ? " with colors" : "");
+    quantizer q = ply.bounds();
+    q.fit(arg.depth ? arg.depth : DEFAULT_DEPTH);
+    printf("[%10.0f] Bounding box (%g, %g, %g) - (%g, %g, %g), %g voxels per unit.\n", t.elapsed(), 
+           q.min[0], q.min[1], q.min[2], q.max[0], q.max[1], q.max[2], q.scale);
+    stream_decoded(arg, counter, in, ply.length, [&](uint64_t begin, uint64_t count, point * list) {
+      ply.decode(begin, count, list, q);
+    });
+  } else {
+    const char * points = hilbert_sort_points(arg, counter);
+    // Map input file to memory
+    printf("[%10.0f] Opening '%s'.\n", t.elapsed(), points);
+    mapped = new pointset(points);
+    in.sorted.add(mapped->list, mapped->length);
+  }
+  
+  if (counter.collapsed) {
+    printf("[%10.0f] Collapsed %lu points into other points in the same voxel, leaving %lu points.\n", t.elapsed(), counter.collapsed, counter.index);
+  }
+  
+  octree_merge * merge = arg.merge.empty() ? nullptr : new octree_merge(arg, in.sorted);
+  layer_info layers = merge ? merge->count_layers(arg, counter) : count_nodes_per_layer(arg, counter);
+  if (!merge) limit_leaf_layer(arg, layers);
+  
+  write_octree(arg, arg.outfile, layers, in.sorted, counter, merge, arg.exported);
+  delete merge;
+  
+  // The levels of detail are built from the same sorted points, with the lower layers collapsed into leaves.
+  for (const level_of_detail &lod : arg.lods) {
+    layer_info lod_layers = layers;
+    lod_layers.bottom_layer = leaf_layer_for_size(layers, lod.size);
+    printf("[%10.0f] Level of detail with leaves in layer %d.\n", t.elapsed(), lod_layers.bottom_layer);
+    write_octree(arg, lod.filename, lod_layers, in.sorted, counter, nullptr, nullptr);
+  }
+  delete mapped;
 
   // Done with conversion, clean up.
   printf("[%10.0f] Done.\n", t.elapsed());
 }
 
-// kate: space-indent on; indent-width 2; mixedindent off; indent-mode cstyle; 
-
+// kate: space-indent on; indent-width 2; mixedindent off; indent-mode cstyle;
@@ -19,6 +19,9 @@
 #include <cstdio>
 #include <cstring>
 #include <algorithm>
+
+#include "ingest.h"
+
 /*
  * Mouna Loa:
  * x: 22600000 - 22999999
@@ -28,26 +31,19 @@
  * lines: 135833540
  */
 
-void open_file(char * name) {
-  // Determine the file names.
-  int length=strlen(name)+5;
-  char infile[length];
-  char outfile[length];
-  sprintf(infile, "input/%s.txt", name);
-  sprintf(outfile, "vxl/%s.vxl", name);
-  
-  // Open the files.
-  FILE * res;
-  res = freopen( infile,  "r", stdin );
-  if (res==NULL) {
-    fprintf(stderr,"Failed to open '%s' for input.\n", infile);
-    exit(2);
-  }
-  res = freopen( outfile, "w", stdout );
-  if (res==NULL) {
-    fprintf(stderr,"Failed to open '%s' for output.\n", outfile);
-    exit(2);
-  }
+struct statistics {
+  int minx=1e9,miny=1e9,minz=1e9;
+  int maxx=0,  maxy=0,  maxz=0;
+  int minint=1e9, maxint=0;
+  double int_sum=0;
+};
+
+/** Parses a number with 2 decimals, written as "%d.%d", into an integer in hundredths. */
+static bool parse_fixed(const char *&p, const char * end, int &value) {
+  int whole, fraction;
+  if (!(parse_int(p, end, whole) && parse_char(p, end, '.') && parse_int(p, end, fraction))) return false;
+  value = whole * 100 + fraction;
+  return true;
 }
 
 int main(int argc, char ** argv) {
@@ -55,44 +51,56 @@ int main(int argc, char ** argv) {
     fprintf(stderr,"Please specify the file to convert (without '.txt').\n");
     exit(2);
   }
-  open_file(argv[1]);
+  // Determine the file names.
+  char * name = argv[1];
+  int length=strlen(name);
+  char infile[length+11];
+  char outfile[length+9];
+  sprintf(infile, "input/%s.txt", name);
+  sprintf(outfile, "vxl/%s.vxl", name);
 
-  char header[1000];
-  fgets(header,1000,stdin);
-  int x1,x2,y1,y2,z1,z2;
-  int clas, t1, t2, angle;
-  int intensity,rets,retno, ptsrc;
-  int eflf, dosf, ud, r,g,b;
-  int minx=1e9,miny=1e9,minz=1e9;
-  int maxx=0,  maxy=0,  maxz=0;
-  int minint=1e9, maxint=0;
-  int line=0;
-  double int_mean=0;
-  for(;;) {
-    if(line%100000==0) fprintf(stderr,"line: %fM\n", line/1.e6);
-    int ret = scanf("%d.%d,%d.%d,%d.%d,", &x1,&x2,&y1,&y2,&z1,&z2);
-    if (ret < 6) break;
-    x1*=100; x1+=x2; x1 -= 22600000;  
-    y1*=100; y1+=y2; y1 -= 215100000; 
-    z1*=100; z1+=z2; z1 -= 373846;    
-    if(minx>x1) minx=x1; if(maxx<x1) maxx=x1;
-    if(miny>y1) miny=y1; if(maxy<y1) maxy=y1;
-    if(minz>z1) minz=z1; if(maxz<z1) maxz=z1;
-    scanf("%d,%d.%d,%d,", &clas,&t1,&t2,&angle);
-    t1*=1000000; t1+=t2;
-    scanf("%d,%d,%d,%d,", &intensity, &rets, &retno, &ptsrc);
-    if(minint>intensity) minint=intensity;
-    if(maxint<intensity) maxint=intensity;
-    int_mean += intensity;
-    scanf("%d,%d,%d,%d,%d,%d", &eflf, &dosf, &ud, &r, &g, &b);
-    printf("%d %d %d %6x\n", x1, z1, y1, 0x10101 * std::min(255, intensity*6));
-    line++;
+  // Open the files.
+  textfile in(infile);
+  pointfile out(outfile);
+
+  // Do the conversion, skipping the header.
+  std::vector<statistics> stats(thread_count());
+  uint64_t count = convert_lines(in, in.next_line(in.data), out, [&](int thread, const char * p, const char * end, std::vector<point> &points) {
+    int x,y,z;
+    int clas, t1, t2, angle;
+    int intensity;
+    if (!(parse_fixed(p, end, x) && parse_char(p, end, ',') && 
+          parse_fixed(p, end, y) && parse_char(p, end, ',') && 
+          parse_fixed(p, end, z) && parse_char(p, end, ','))) return;
+    x -= 22600000;  
+    y -= 215100000; 
+    z -= 373846;    
+    statistics &s = stats[thread];
+    if(s.minx>x) s.minx=x; if(s.maxx<x) s.maxx=x;
+    if(s.miny>y) s.miny=y; if(s.maxy<y) s.maxy=y;
+    if(s.minz>z) s.minz=z; if(s.maxz<z) s.maxz=z;
+    if (!(parse_int(p, end, clas) && parse_char(p, end, ',') && 
+          parse_int(p, end, t1) && parse_char(p, end, '.') && parse_int(p, end, t2) && parse_char(p, end, ',') &&
+          parse_int(p, end, angle) && parse_char(p, end, ',') && 
+          parse_int(p, end, intensity))) return;
+    if(s.minint>intensity) s.minint=intensity;
+    if(s.maxint<intensity) s.maxint=intensity;
+    s.int_sum += intensity;
+    points.push_back(point(x, z, y, 0x10101 * std::min(255, intensity*6)));
+  });
+  statistics total;
+  for (const statistics &s : stats) {
+    total.minx = std::min(total.minx, s.minx); total.maxx = std::max(total.maxx, s.maxx);
+    total.miny = std::min(total.miny, s.miny); total.maxy = std::max(total.maxy, s.maxy);
+    total.minz = std::min(total.minz, s.minz); total.maxz = std::max(total.maxz, s.maxz);
+    total.minint = std::min(total.minint, s.minint); total.maxint = std::max(total.maxint, s.maxint);
+    total.int_sum += s.int_sum;
   }
-  fprintf(stderr,"x: %d - %d\n", minx, maxx);
-  fprintf(stderr,"y: %d - %d\n", miny, maxy);
-  fprintf(stderr,"z: %d - %d\n", minz, maxz);  
-  fprintf(stderr,"intensity: %d - %d, avg: %f\n", minint, maxint, int_mean/line);  
-  fprintf(stderr,"lines: %d\n", line);
+  fprintf(stderr,"x: %d - %d\n", total.minx, total.maxx);
+  fprintf(stderr,"y: %d - %d\n", total.miny, total.maxy);
+  fprintf(stderr,"z: %d - %d\n", total.minz, total.maxz);  
+  fprintf(stderr,"intensity: %d - %d, avg: %f\n", total.minint, total.maxint, total.int_sum/count);  
+  fprintf(stderr,"lines: %lu\n", count);
 }
 
 // kate: space-indent on; indent-width 2; mixedindent off; indent-mode cstyle; 
@@ -17,10 +17,11 @@
 */
 
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <algorithm>
 
-#include "pointset.h"
+#include "ingest.h"
 
 /*
  * Tower:
@@ -30,9 +31,23 @@
  * lines: 152209633
  */
 
+struct bounds {
+  int minx= 1e9,miny= 1e9,minz= 1e9;
+  int maxx=-1e9,maxy=-1e9,maxz=-1e9;
+};
+
 int main(int argc, char ** argv) {
-  if (argc != 2) {
+  int depth = 0;
+  if (argc >= 3 && strcmp(argv[1], "-depth") == 0) {
+    depth = atoi(argv[2]);
+    argc -= 2;
+    argv += 2;
+  }
+  if ((argc != 2 && argc != 3) || depth < 0 || depth > 20) {
+    fprintf(stderr,"Usage: convert2 [-depth N] xyzrgb [output]\n");
     fprintf(stderr,"Please specify the file to convert (without '.xyz').\n");
+    fprintf(stderr,"The output file can be given as second argument, use - to write to standard output.\n");
+    fprintf(stderr,"With -depth N, the points are quantized such that the longest side of their bounding box spans 2^N voxels.\n");
     exit(2);
   }
   // Determine the file names.
@@ -42,40 +57,58 @@ int main(int argc, char ** argv) {
   char outfile[length+9];
   sprintf(infile, "input/%s.xyz", name);
   sprintf(outfile, "vxl/%s.vxl", name);
+  const char * output = argc == 3 ? argv[2] : outfile;
     
   // Open the files.
-  FILE * res;
-  res = freopen( infile,  "r", stdin );
-  if (res==NULL) {
-    fprintf(stderr,"Failed to open '%s' for input.\n", infile);
-    exit(2);
+  textfile in(infile);
+  pointfile out(output);
+
+  // With -depth, a first pass computes the bounding box to which the points are quantized.
+  quantizer q;
+  if (depth) {
+    std::vector<quantizer> parts(thread_count());
+    scan_lines(in, in.data, [&](int thread, const char * p, const char * end) {
+      double x,y,z;
+      if (parse_double(p, end, x) && parse_double(p, end, y) && parse_double(p, end, z)) parts[thread].add(x, y, z);
+    });
+    for (const quantizer &part : parts) q.add(part);
+    q.fit(depth);
+    fprintf(stderr,"bounds: (%g, %g, %g) - (%g, %g, %g), %g voxels per unit\n", q.min[0], q.min[1], q.min[2], q.max[0], q.max[1], q.max[2], q.scale);
   }
-  pointfile out(outfile);
 
-  // Do the conversion
-  double x,y,z;
-  int r,g,b;
-  int minx= 1e9,miny= 1e9,minz= 1e9;
-  int maxx=-1e9,maxy=-1e9,maxz=-1e9;
-  int line=0;
-  const int C = 1<<19;
-  for(;;) {
-    if(line%(1<<20)==0) fprintf(stderr,"line: %3dMi\n", line>>20);
-    int ret = scanf("%lf %lf %lf %d %d %d\n", &x,&y,&z, &r,&g,&b);
-    if (ret < 6) break;
-    x*=1000;
-    y*=1000;
-    z*=1000;
-    if(minx>x) minx=x; if(maxx<x) maxx=x;
-    if(miny>y) miny=y; if(maxy<y) maxy=y;
-    if(minz>z) minz=z; if(maxz<z) maxz=z;
-    out.add(point((int)(x+C), (int)(z+C), (int)(y+C), (r<<16)+(g<<8)+b));
-    line++;
+  // Do the conversion, lines that do not contain 6 numbers are skipped.
+  std::vector<bounds> stats(thread_count());
+  const int C = depth ? 0 : 1<<19;
+  uint64_t count = convert_lines(in, in.data, out, [&](int thread, const char * p, const char * end, std::vector<point> &points) {
+    double x,y,z;
+    int r,g,b;
+    if (!(parse_double(p, end, x) && parse_double(p, end, y) && parse_double(p, end, z) && 
+          parse_int(p, end, r) && parse_int(p, end, g) && parse_int(p, end, b))) return;
+    if (depth) {
+      x = q.voxel(0, x);
+      y = q.voxel(1, y);
+      z = q.voxel(2, z);
+    } else {
+      x*=1000;
+      y*=1000;
+      z*=1000;
+    }
+    bounds &s = stats[thread];
+    if(s.minx>x) s.minx=x; if(s.maxx<x) s.maxx=x;
+    if(s.miny>y) s.miny=y; if(s.maxy<y) s.maxy=y;
+    if(s.minz>z) s.minz=z; if(s.maxz<z) s.maxz=z;
+    points.push_back(point((int)(x+C), (int)(z+C), (int)(y+C), (r<<16)+(g<<8)+b));
+  });
+  bounds total;
+  for (const bounds &s : stats) {
+    total.minx = std::min(total.minx, s.minx); total.maxx = std::max(total.maxx, s.maxx);
+    total.miny = std::min(total.miny, s.miny); total.maxy = std::max(total.maxy, s.maxy);
+    total.minz = std::min(total.minz, s.minz); total.maxz = std::max(total.maxz, s.maxz);
   }
-  fprintf(stderr,"x: %d - %d\n", minx, maxx);
-  fprintf(stderr,"y: %d - %d\n", miny, maxy);
-  fprintf(stderr,"z: %d - %d\n", minz, maxz);  
-  fprintf(stderr,"lines: %d\n", line);
+  fprintf(stderr,"x: %d - %d\n", total.minx, total.maxx);
+  fprintf(stderr,"y: %d - %d\n", total.miny, total.maxy);
+  fprintf(stderr,"z: %d - %d\n", total.minz, total.maxz);  
+  fprintf(stderr,"lines: %lu\n", count);
 }
 
 // kate: space-indent on; indent-width 2; mixedindent off; indent-mode cstyle; 
@@ -0,0 +1,56 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef COLOR_H
+#define COLOR_H
+#include <stdint.h>
+#include <cassert>
+
+/** Sum of a number of colors, used to compute average colors.
+ * The sums are integers, such that all tools round the averages in the same way.
+ * T is the integer type of the sums, which must be able to hold 255 times the number of colors.
+ */
+template<class T>
+struct basic_color_sum {
+    T r,g,b,n;
+    basic_color_sum() : r(0), g(0), b(0), n(0) {}
+    basic_color_sum(uint32_t v) : r((v&0xff0000)>>16), g((v&0xff00)>>8), b((v&0xff)), n(1) {}
+    void operator+=(const basic_color_sum &w) {
+        r+=w.r;
+        g+=w.g;
+        b+=w.b;
+        n+=w.n;
+    }
+    /** Adds the given color with the given weight. The upper 8 bits of the color are ignored. */
+    void add(uint32_t v, uint64_t w) {
+        r += (T)w * ((v>>16)&0xff);
+        g += (T)w * ((v>>8)&0xff);
+        b += (T)w * (v&0xff);
+        n += w;
+    }
+    /** Returns the average color, rounded to nearest. */
+    uint32_t color() const {
+        assert(n>0);
+        return (uint32_t)((2*r+n)/(2*n))<<16 | (uint32_t)((2*g+n)/(2*n))<<8 | (uint32_t)((2*b+n)/(2*n));
+    }
+};
+
+/** Color sum that holds up to 2^56 colors. */
+typedef basic_color_sum<uint64_t> color_sum;
+
+#endif
@@ -0,0 +1,88 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef HILBERT_H
+#define HILBERT_H
+#include <stdint.h>
+
+#include "pointset.h"
+
+/**
+ * Keys of points along space filling curves, with 20 bits per coordinate.
+ * The points of a cube of 2^k voxels that is aligned to its size have consecutive keys,
+ * which only differ in the lower 3k bits.
+ */
+
+static const uint64_t MORTON_B[] = {
+    0xFFFF00000000FFFF,
+    0x00FF0000FF0000FF,
+    0xF00F00F00F00F00F,
+    0x30C30C30C30C30C3,
+    0x9249249249249249,
+};
+static const uint64_t MORTON_S[] = {32, 16, 8, 4, 2};
+
+static inline uint64_t morton3d( uint64_t x, uint64_t y, uint64_t z ) {
+    // pack 3 32-bit indices into a 96-bit Morton code
+    // except that the result is truncated to 64-bit.
+    for (uint64_t i=0; i<5; i++) {
+        x = (x | (x << MORTON_S[i])) & MORTON_B[i];
+        y = (y | (y << MORTON_S[i])) & MORTON_B[i];
+        z = (z | (z << MORTON_S[i])) & MORTON_B[i];
+    }
+    return x | (y<<1) | (z<<2);
+}
+
+/** Inverse of morton3d, for coordinates of at most 21 bits. */
+static inline void morton3d_inverse( uint64_t m, uint32_t &x, uint32_t &y, uint32_t &z ) {
+    uint64_t v[3] = {m, m>>1, m>>2};
+    for (int j=0; j<3; j++) {
+        v[j] &= MORTON_B[4];
+        for (int i=4; i>0; i--) {
+            v[j] = (v[j] | (v[j] >> MORTON_S[i])) & MORTON_B[i-1];
+        }
+        v[j] = (v[j] | (v[j] >> MORTON_S[0])) & 0x1fffff;
+    }
+    x = v[0];
+    y = v[1];
+    z = v[2];
+}
+
+/** The octree is written in this order, such that subtrees are contiguous and neighbouring nodes are close. */
+static inline uint64_t hilbert3d( const point & p ) {
+    uint64_t val = morton3d( p.x,p.y,p.z );
+    uint64_t start = 0;
+    uint64_t end = 1; // can be 1,2,4
+    uint64_t ret = 0;
+    for (int64_t j=19; j>=0; j--) {
+        uint64_t rg = ((val>>(3*j))&7) ^ start;
+        uint64_t travel_shift = (0x30210 >> (start ^ end)*4)&3;
+        uint64_t i = (((rg << 3) | rg) >> travel_shift ) & 7;
+        i = (0x54672310 >> i*4) & 7;
+        ret = (ret<<3) | i;
+        uint64_t si = (0x64422000 >> i*4 ) & 7; // next lower even number, or 0
+        uint64_t ei = (0x77755331 >> i*4 ) & 7; // next higher odd number, or 7
+        uint64_t sg = ( si ^ (si>>1) ) << travel_shift;
+        uint64_t eg = ( ei ^ (ei>>1) ) << travel_shift;
+        end   = ( ( eg | ( eg >> 3 ) ) & 7 ) ^ start;
+        start = ( ( sg | ( sg >> 3 ) ) & 7 ) ^ start;
+    }
+    return ret;
+}
+
+#endif
@@ -0,0 +1,51 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ingest.h"
+
+textfile::textfile(const char* filename) {
+    fd = open(filename, O_RDONLY);
+    if (fd == -1) {perror("Could not open file"); exit(1);}
+    size = lseek(fd, 0, SEEK_END);
+    data = NULL;
+    if (size > 0) {
+        data = (const char*)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {perror("Could not map file to memory"); exit(1);}
+        madvise((void*)data, size, MADV_SEQUENTIAL);
+    }
+    end = data + size;
+}
+
+textfile::~textfile() {
+    if (data)
+        munmap((void*)data, size);
+    if (fd!=-1)
+        close(fd);
+}
+
+const char * textfile::next_line(const char* p) const {
+    const char * eol = (const char*)memchr(p, '\n', end - p);
+    return eol ? eol + 1 : end;
+}
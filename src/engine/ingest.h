@@ -0,0 +1,280 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef INGEST_H
+#define INGEST_H
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+#include "parallel.h"
+#include "pointset.h"
+
+/**
+ * Number parsers for the text converters, which replace scanf.
+ * They skip leading spaces and tabs, parse the number at p and advance p past it.
+ * If there is no number at p, they return false and leave p unchanged.
+ * The number format does not depend on the locale.
+ */
+static inline void skip_spaces(const char *&p, const char * end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+}
+
+/** Skips spaces and the character c. Returns false if the next character is not c. */
+static inline bool parse_char(const char *&p, const char * end, char c) {
+    const char * q = p;
+    skip_spaces(q, end);
+    if (q == end || *q != c) return false;
+    p = q + 1;
+    return true;
+}
+
+static inline bool parse_int(const char *&p, const char * end, int64_t &value) {
+    const char * q = p;
+    skip_spaces(q, end);
+    bool negative = false;
+    if (q < end && (*q == '-' || *q == '+')) negative = *q++ == '-';
+    if (q == end || *q < '0' || *q > '9') return false;
+    int64_t v = 0;
+    while (q < end && *q >= '0' && *q <= '9') v = v * 10 + (*q++ - '0');
+    value = negative ? -v : v;
+    p = q;
+    return true;
+}
+
+static inline bool parse_int(const char *&p, const char * end, int &value) {
+    int64_t v;
+    if (!parse_int(p, end, v)) return false;
+    value = v;
+    return true;
+}
+
+static inline bool parse_uint(const char *&p, const char * end, uint32_t &value) {
+    int64_t v;
+    if (!parse_int(p, end, v)) return false;
+    value = v;
+    return true;
+}
+
+static inline bool parse_hex(const char *&p, const char * end, uint32_t &value) {
+    const char * q = p;
+    skip_spaces(q, end);
+    uint32_t v = 0;
+    const char * start = q;
+    for (; q < end; q++) {
+        char c = *q;
+        if (c >= '0' && c <= '9') v = v * 16 + (c - '0');
+        else if (c >= 'a' && c <= 'f') v = v * 16 + (c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F') v = v * 16 + (c - 'A' + 10);
+        else break;
+    }
+    if (q == start) return false;
+    value = v;
+    p = q;
+    return true;
+}
+
+/**
+ * Parses a decimal number with optional fraction and exponent.
+ * The digits are collected into an integer, which is scaled by an exact power of 10,
+ * such that the result equals that of strtod for up to 15 significant digits.
+ * Longer numbers can differ in the last bit.
+ */
+static inline bool parse_double(const char *&p, const char * end, double &value) {
+    static const double powers[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+    };
+    const char * q = p;
+    skip_spaces(q, end);
+    bool negative = false;
+    if (q < end && (*q == '-' || *q == '+')) negative = *q++ == '-';
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool found = false;
+    for (; q < end && *q >= '0' && *q <= '9'; q++) {
+        found = true;
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*q - '0');
+            if (mantissa) digits++;
+        } else {
+            exponent++;
+        }
+    }
+    if (q < end && *q == '.') {
+        for (q++; q < end && *q >= '0' && *q <= '9'; q++) {
+            found = true;
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*q - '0');
+                if (mantissa) digits++;
+                exponent--;
+            }
+        }
+    }
+    if (!found) return false;
+    if (q < end && (*q == 'e' || *q == 'E')) {
+        const char * r = q + 1;
+        int64_t e;
+        if (parse_int(r, end, e)) {
+            exponent += e;
+            q = r;
+        }
+    }
+    double v = mantissa;
+    if (exponent > 22 || exponent < -22) {
+        v *= pow(10, exponent);
+    } else if (exponent >= 0) {
+        v *= powers[exponent];
+    } else {
+        v /= powers[-exponent];
+    }
+    value = negative ? -v : v;
+    p = q;
+    return true;
+}
+
+/**
+ * Bounding box of points with real coordinates, which is used to quantize the coordinates into voxels.
+ */
+struct quantizer {
+    double min[3];
+    double max[3];
+    double scale; /// Number of voxels per unit.
+    quantizer() : scale(1) {
+        for (int i=0; i<3; i++) {
+            min[i] = HUGE_VAL;
+            max[i] = -HUGE_VAL;
+        }
+    }
+    void add(double x, double y, double z) {
+        double v[3] = {x, y, z};
+        for (int i=0; i<3; i++) {
+            if (min[i] > v[i]) min[i] = v[i];
+            if (max[i] < v[i]) max[i] = v[i];
+        }
+    }
+    void add(const quantizer &q) {
+        for (int i=0; i<3; i++) {
+            if (min[i] > q.min[i]) min[i] = q.min[i];
+            if (max[i] < q.max[i]) max[i] = q.max[i];
+        }
+    }
+    /** Chooses the scale such that the longest side of the bounding box spans 2^depth voxels. */
+    void fit(int depth) {
+        double extent = std::max(max[0] - min[0], std::max(max[1] - min[1], max[2] - min[2]));
+        scale = extent > 0 ? ((1<<depth) - 1) / extent : 1;
+    }
+    /** Returns the voxel coordinate of v along the given axis. */
+    uint32_t voxel(int axis, double v) const {
+        double r = (v - min[axis]) * scale + 0.5;
+        return r < 0 ? 0 : r > 4294967295. ? 0xffffffffu : (uint32_t)r;
+    }
+};
+
+/**
+ * A text file that is mapped into memory for parsing.
+ */
+struct textfile {
+    int32_t fd;
+    uint64_t size;
+    const char * data;
+    const char * end;
+    textfile(const char * filename);
+    ~textfile();
+    /** Returns the start of the line after the one containing p, or end if it is the last line. */
+    const char * next_line(const char * p) const;
+};
+
+/**
+ * Splits the text starting at begin at line boundaries into one chunk per thread,
+ * and calls parse(thread, line, eol) for each line, with the lines of a chunk in order.
+ * This is used for a first pass over the file, which does not produce points.
+ */
+template<class F>
+void scan_lines(const textfile &in, const char * begin, F parse) {
+    int threads = thread_count();
+    std::vector<const char *> bounds(threads + 1);
+    for (int i = 0; i <= threads; i++) {
+        bounds[i] = i == 0 ? begin : i == threads ? in.end : in.next_line(begin + (in.end - begin) * i / threads);
+        if (bounds[i] < bounds[std::max(i-1, 0)]) bounds[i] = bounds[i-1];
+    }
+    parallel_ranges(threads, [&](int, uint64_t b, uint64_t e) {
+        for (uint64_t i = b; i < e; i++) {
+            for (const char * line = bounds[i]; line < bounds[i+1];) {
+                const char * eol = (const char *)memchr(line, '\n', bounds[i+1] - line);
+                if (!eol) eol = bounds[i+1];
+                parse((int)i, line, eol);
+                line = eol + 1;
+            }
+        }
+    });
+}
+
+/** Size of the chunk of text that is parsed by a thread in one go. */
+static const uint64_t INGEST_CHUNK_SIZE = 1<<24;
+
+/**
+ * Converts the lines of a text file, starting at begin, into points.
+ * The text is split at line boundaries into one chunk per thread, which are parsed in parallel.
+ * For each line, parse(thread, line, eol, points) is called, with eol pointing at the end of the line.
+ * It appends the points of the line to points, which is the buffer of the chunk.
+ * The buffers are handed to out in the order of the input, which writes them while the next chunks are parsed.
+ * Each thread uses the same chunk index, such that parse can keep per thread statistics.
+ * Returns the number of points.
+ */
+template<class F>
+uint64_t convert_lines(const textfile &in, const char * begin, pointfile &out, F parse) {
+    int threads = thread_count();
+    std::vector<std::vector<point>> points(threads);
+    std::vector<const char *> bounds(threads + 1);
+    uint64_t total = 0;
+    while (begin < in.end) {
+        bounds[0] = begin;
+        for (int i = 1; i <= threads; i++) {
+            if ((uint64_t)(in.end - bounds[i-1]) <= INGEST_CHUNK_SIZE) {
+                bounds[i] = in.end;
+            } else {
+                bounds[i] = in.next_line(bounds[i-1] + INGEST_CHUNK_SIZE);
+            }
+        }
+        parallel_ranges(threads, [&](int, uint64_t b, uint64_t e) {
+            for (uint64_t i = b; i < e; i++) {
+                points[i].clear();
+                for (const char * line = bounds[i]; line < bounds[i+1];) {
+                    const char * eol = (const char *)memchr(line, '\n', bounds[i+1] - line);
+                    if (!eol) eol = bounds[i+1];
+                    parse((int)i, line, eol, points[i]);
+                    line = eol + 1;
+                }
+            }
+        });
+        for (int i = 0; i < threads; i++) {
+            out.add_many(points[i].data(), points[i].size());
+            total += points[i].size();
+        }
+        begin = bounds[threads];
+        fprintf(stderr, "points: %3luMi, %3.0f%%\n", total >> 20, (begin - in.data) * 100. / in.size);
+    }
+    return total;
+}
+
+#endif
@@ -0,0 +1,152 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "lasfile.h"
+
+template<class T>
+static inline T read_le(const uint8_t * p) {
+    T v;
+    memcpy(&v, p, sizeof(T));
+    return v;
+}
+
+/** Offsets of the fields in the public header block. */
+enum {
+    LAS_VERSION_MINOR  = 25,
+    LAS_HEADER_SIZE    = 94,
+    LAS_POINT_OFFSET   = 96,
+    LAS_POINT_FORMAT   = 104,
+    LAS_RECORD_LENGTH  = 105,
+    LAS_POINT_COUNT    = 107,
+    LAS_SCALE          = 131,
+    LAS_OFFSET         = 155,
+    LAS_BOUNDS         = 179, // max x, min x, max y, min y, max z, min z
+    LAS_POINT_COUNT_14 = 247,
+};
+
+/** Size of the point record of the formats 0 to 3, excluding extra bytes. */
+static const uint32_t record_sizes[] = {20, 28, 26, 34};
+/** Offset of the red, green and blue values in the point record of the formats 2 and 3. */
+static const uint32_t color_offsets[] = {0, 0, 20, 28};
+
+lasfile::lasfile(const char* filename, double resolution) {
+    fd = open(filename, O_RDONLY);
+    if (fd == -1) {perror("Could not open file"); exit(1);}
+    size = lseek(fd, 0, SEEK_END);
+    if (size < 227) {fprintf(stderr, "File is too small to be a LAS file.\n"); exit(1);}
+    data = (const uint8_t*)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {perror("Could not map file to memory"); exit(1);}
+
+    // Parse the header.
+    if (memcmp(data, "LASF", 4) != 0) {fprintf(stderr, "File is not a LAS file.\n"); exit(1);}
+    format = data[LAS_POINT_FORMAT];
+    if (format & 0xc0) {fprintf(stderr, "Compressed LAS files are not supported.\n"); exit(1);}
+    if (format > 3) {fprintf(stderr, "LAS point data format %d is not supported.\n", format); exit(1);}
+    record_length = read_le<uint16_t>(data + LAS_RECORD_LENGTH);
+    if (record_length < record_sizes[format]) {fprintf(stderr, "LAS point records are too short.\n"); exit(1);}
+    point_offset = read_le<uint32_t>(data + LAS_POINT_OFFSET);
+    length = read_le<uint32_t>(data + LAS_POINT_COUNT);
+    if (length == 0 && data[LAS_VERSION_MINOR] >= 4 && read_le<uint16_t>(data + LAS_HEADER_SIZE) >= 255) {
+        length = read_le<uint64_t>(data + LAS_POINT_COUNT_14);
+    }
+    if (point_offset + length * record_length > size) {fprintf(stderr, "LAS file is truncated.\n"); exit(1);}
+    for (int i=0; i<3; i++) {
+        scale[i]  = read_le<double>(data + LAS_SCALE + i*8);
+        offset[i] = read_le<double>(data + LAS_OFFSET + i*8);
+        max[i]    = read_le<double>(data + LAS_BOUNDS + i*16);
+        min[i]    = read_le<double>(data + LAS_BOUNDS + i*16 + 8);
+        if (!(scale[i] > 0)) {fprintf(stderr, "LAS file has an invalid scale.\n"); exit(1);}
+        base[i] = floor((min[i] - offset[i]) / scale[i] + 0.5);
+        factor[i] = resolution > 0 ? scale[i] / resolution : 1;
+    }
+    madvise((void*)data, size, MADV_SEQUENTIAL);
+
+    // Colors and intensities should use 16 bits, but some files only use the lower 8 bits.
+    uint32_t field = format >= 2 ? color_offsets[format] : 12;
+    int fields = format >= 2 ? 3 : 1;
+    uint16_t highest = 0;
+    for (uint64_t i=0; i<std::min<uint64_t>(length, 1<<16); i++) {
+        const uint8_t * record = data + point_offset + i * record_length;
+        for (int j=0; j<fields; j++) {
+            highest = std::max(highest, read_le<uint16_t>(record + field + j*2));
+        }
+    }
+    color_shift = highest > 255 ? 8 : 0;
+}
+
+lasfile::~lasfile() {
+    if (data!=MAP_FAILED)
+        munmap((void*)data, size);
+    if (fd!=-1)
+        close(fd);
+}
+
+void lasfile::fit(int depth) {
+    double extent = std::max(max[0] - min[0], std::max(max[1] - min[1], max[2] - min[2]));
+    for (int i=0; i<3; i++) {
+        factor[i] = extent > 0 ? ((1<<depth) - 1) * scale[i] / extent : 1;
+    }
+}
+
+uint64_t lasfile::extent(int i) const {
+    static const int axis[] = {0, 2, 1};
+    int j = axis[i];
+    return (uint64_t)((floor((max[j] - offset[j]) / scale[j] + 0.5) - base[j]) * factor[j] + 0.5) + 1;
+}
+
+/** Converts an integer coordinate into the nearest voxel coordinate, clamping points outside the bounding box. */
+static inline uint32_t voxel(int32_t v, int32_t base, double factor) {
+    double r = ((int64_t)v - base) * factor + 0.5;
+    return r < 0 ? 0 : r > 4294967295. ? 0xffffffffu : (uint32_t)r;
+}
+
+void lasfile::decode(uint64_t begin, uint64_t count, point* list) const {
+    const uint8_t * record = data + point_offset + begin * record_length;
+    uint32_t color_offset = color_offsets[format];
+    for (uint64_t i=0; i<count; i++, record += record_length) {
+        uint32_t x = voxel(read_le<int32_t>(record + 0), base[0], factor[0]);
+        uint32_t y = voxel(read_le<int32_t>(record + 4), base[1], factor[1]);
+        uint32_t z = voxel(read_le<int32_t>(record + 8), base[2], factor[2]);
+        uint32_t c;
+        if (color_offset) {
+            uint32_t r = read_le<uint16_t>(record + color_offset + 0) >> color_shift;
+            uint32_t g = read_le<uint16_t>(record + color_offset + 2) >> color_shift;
+            uint32_t b = read_le<uint16_t>(record + color_offset + 4) >> color_shift;
+            c = (std::min(r, 255u) << 16) | (std::min(g, 255u) << 8) | std::min(b, 255u);
+        } else {
+            uint32_t intensity = std::min(read_le<uint16_t>(record + 12) >> color_shift, 255);
+            c = 0x10101 * intensity;
+        }
+        list[i] = point(x, z, y, c);
+    }
+}
+
+bool is_lasfile(const char* filename) {
+    int n = strlen(filename);
+    return n >= 4 && strcasecmp(filename + n - 4, ".las") == 0;
+}
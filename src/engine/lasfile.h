@@ -0,0 +1,61 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LASFILE_H
+#define LASFILE_H
+#include <stdint.h>
+
+#include "pointset.h"
+
+/**
+ * Opens a LiDAR point cloud in the binary LAS format (version 1.0 to 1.4, point data formats 0 to 3) for reading.
+ * The points are decoded into voxel coordinates relative to the bounding box in the header.
+ * The LAS Z axis, which points up, is mapped to the Y axis of the engine.
+ * Points with color (formats 2 and 3) keep their color, the other points are colored by their intensity.
+ */
+struct lasfile {
+    int32_t fd;
+    uint64_t size;      /// Number of bytes in the file.
+    const uint8_t * data;
+    uint64_t length;    /// Number of points in the file.
+    int format;         /// Point data format.
+    uint32_t record_length;
+    uint64_t point_offset;
+    double scale[3];    /// Scale and offset of the integer coordinates in the records.
+    double offset[3];
+    double min[3];      /// Bounding box of the points, in the units of the file.
+    double max[3];
+    int32_t base[3];    /// Integer coordinate that is mapped to voxel 0.
+    double factor[3];   /// Number of voxels per integer coordinate.
+    int color_shift;    /// Shift that reduces the colors or intensities to 8 bits.
+    /** Opens the file. The voxels have the given size in the units of the file,
+     * which defaults to the resolution of the coordinates in the file. */
+    lasfile(const char * filename, double resolution = 0);
+    ~lasfile();
+    /** Chooses the voxel size such that the longest side of the bounding box spans 2^depth voxels. */
+    void fit(int depth);
+    /** Returns the number of voxels spanned by the bounding box along the engine axis i. */
+    uint64_t extent(int i) const;
+    /** Decodes the count points starting at begin. */
+    void decode(uint64_t begin, uint64_t count, point * list) const;
+};
+
+/** Returns whether the file name has the .las extension. */
+bool is_lasfile(const char * filename);
+
+#endif
@@ -19,6 +19,8 @@
 #ifndef OCTREE_H
 #define OCTREE_H
 #include <stdint.h>
+#include <atomic>
+#include <thread>
 #include <glm/glm.hpp>
 #include "surface.h"
 
@@ -26,6 +28,10 @@ static inline int popcount(int v) {
     return __builtin_popcount(v);
 }
 
+static inline int popcount64(uint64_t v) {
+    return __builtin_popcountll(v);
+}
+
 /** A node in an octree. 
  *
  * Indices are a bitwise or of the following values:
@@ -36,6 +42,13 @@ static inline int popcount(int v) {
  * 1 = neg-x, neg-y, pos-z
  * etc...
  * 
+ * A node with bitmask 0 is a brick, which stores the two layers above the leaves as a 4x4x4 block.
+ * Its child array starts with a 64 bit occupancy mask, followed by a 3 byte color for every leaf,
+ * or a 1 or 2 byte palette index if the file has a palette.
+ * 
+ * In files with split colors, the first element of the child array is the index of the color of the node 
+ * in the color array, followed by the pointers to the children. Nodes in the layer above the leaves have 
+ * avgcolor OCTREE_SPLIT_LEAVES and do not store their children, the colors of which follow the color of the node.
  */
 struct octree {
     uint32_t avgcolor:24;
@@ -64,19 +77,146 @@ struct octree {
         return pos;
     }
     void set_color(int pos, uint32_t color) { child[pos] = (color | 0xff000000u); }
+    
+    /** Checks whether this node is a brick. */
+    bool is_brick() const { return bitmask == 0; }
+    /** Returns the occupancy mask of a brick. Bit i*8+j is set if leaf j of child i exists. */
+    uint64_t occupancy() const { return child[0] | (uint64_t)child[1] << 32; }
+    /** Returns the color of the leaf at the given bit of the occupancy mask of a brick, 
+     * given the number of bytes used per color. */
+    uint32_t brick_color(int bit, int bytes = 3) const { 
+        const uint8_t * c = (const uint8_t*)(child + 2) + bytes * popcount64(occupancy() & ((1ull << bit) - 1));
+        uint32_t color = 0;
+        for (int i=0; i<bytes; i++) {
+            color |= c[i] << i*8;
+        }
+        return color;
+    }
+};
+
+/** Format flags stored in octree_header::flags. */
+enum octree_flags {
+    /** The nodes are grouped per layer, with the layers stored top-down as given by layer_start and layer_end. */
+    OCTREE_LAYERED = 1,
+    /** The colors are stored in a separate array, with one entry per node and per leaf. 
+     * The nodes only store their bitmask, the index of their color and their child pointers, see octree.
+     * This layout requires version 2. */
+    OCTREE_SPLIT_COLORS = 2,
+    /** The nodes in the layer 2 above bottom_layer are bricks and the layer in between is empty. */
+    OCTREE_BRICKS = 4,
+    /** All colors are indices in the palette. */
+    OCTREE_PALETTE = 8,
+    /** Identical subtrees are stored once and shared by several parents, hence the nodes form a DAG. 
+     * A subtree does not occupy a contiguous range of every layer, which build_db -merge relies on. */
+    OCTREE_SHARED = 16,
+    OCTREE_KNOWN_FLAGS = OCTREE_LAYERED | OCTREE_SPLIT_COLORS | OCTREE_BRICKS | OCTREE_PALETTE | OCTREE_SHARED,
+};
+
+/** The avgcolor of nodes in files with split colors whose children are leaves, which are not stored. */
+static const uint32_t OCTREE_SPLIT_LEAVES = 1;
+
+/** Upper bound on the number of words used by a node and its child array, which is reached by bricks. */
+static const uint32_t OCTREE_MAX_NODE_SIZE = 3 + 64;
+
+/** Upper bound on the size of the node array in bytes, as the size of the file, including its header, is stored in 32 bits.
+ * This also keeps the node indices below 0xff000000, where leaves start. */
+static const uint64_t OCTREE_MAX_FILESIZE = 0xffffffffu - 512;
+
+/** How octree_file loads a file for reading. */
+enum octree_loading {
+    /** The file is mapped to memory and loaded on demand by page faults. */
+    OCTREE_MAPPED,
+    /** The file is mapped to memory and loaded front to back by a background thread. 
+     * As the layers are stored top-down, the model can be rendered at a low level of detail 
+     * while the deeper layers are still being loaded. */
+    OCTREE_PROGRESSIVE,
+};
+
+static const uint32_t OCTREE_MAGIC = 0x0032434f; //< "OC2\0", which is a root node without children in legacy files.
+static const uint32_t OCTREE_VERSION = 2; //< Newest supported version. Files are written with the oldest version that can store them.
+
+/** Header of an .oc2 file, which precedes the node array.
+ *
+ * Legacy files have no header and start with the root node. As the root node of a valid octree 
+ * always has children, the bitmask in the upper byte of its first word is never 0, which
+ * is used to distinguish these files from files that start with OCTREE_MAGIC.
+ * 
+ * Layers are numbered bottom-up, as in build_db. Layer information is -1 if unknown.
+ */
+struct octree_header {
+    static const int LAYERS = 21;
+    static const uint32_t CHECKSUM_NODES = 4096;
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;         //< Bitwise or of octree_flags.
+    uint32_t header_size;   //< Offset of the root node in bytes.
+    uint32_t node_size;     //< Size of the node array in bytes.
+    int32_t top_repeat_layer;
+    int32_t top_data_layer;
+    int32_t bottom_layer;
+    int32_t repeat_mask;
+    int32_t repeat_depth;
+    uint32_t layer_start[LAYERS]; //< Index of the first node of each layer.
+    uint32_t layer_end[LAYERS];   //< Index past the last node of each layer.
+    uint32_t bounds_min[3]; //< Bounding box of the model in voxels (x, y, z), before repetition.
+    uint32_t bounds_max[3]; //< Inclusive, bounds_max < bounds_min if unknown.
+    uint32_t checksum_size; //< Number of nodes at the start of the node array that are covered by the checksum.
+    uint32_t checksum;      //< FNV-1a hash of these nodes.
+    uint32_t color_offset;  //< File offset of the color array if OCTREE_SPLIT_COLORS is set.
+    uint32_t palette_offset;//< File offset of the palette if OCTREE_PALETTE is set.
+    uint32_t palette_size;  //< Number of colors in the palette.
+    uint32_t color_count;   //< Number of entries in the color array if OCTREE_SPLIT_COLORS is set.
+    uint32_t reserved[64];
+    
+    /** Initializes the header of a file containing size bytes of nodes, with unknown structure. */
+    void init(uint32_t size);
+    /** Returns whether the bounding box is known. */
+    bool has_bounds() const { return bounds_min[0] <= bounds_max[0]; }
+    /** Returns the number of bytes per color in the color array or in bricks. */
+    uint32_t color_bytes() const {
+        if (flags & OCTREE_PALETTE) return palette_size <= 256 ? 1 : 2;
+        return (flags & OCTREE_SPLIT_COLORS) ? 4 : 3;
+    }
 };
 
 struct octree_file {
     const bool write;
-    uint32_t size;
+    uint32_t size; //< Size of the node array in bytes.
     int32_t fd;
     octree * root;
+    /** The color array if the colors are stored separately, otherwise nullptr. 
+     * Its elements are header.color_bytes() in size. */
+    uint8_t * colors;
+    /** The palette if the colors are palette indices, otherwise nullptr. */
+    uint32_t * palette;
+    /** Copy of the header. For legacy files this is derived from the file size. 
+     * When writing, changes are stored in the file when it is closed. */
+    octree_header header;
+    /** The nodes with an index below this number are loaded, including their child arrays and colors.
+     * This equals the number of nodes once the file is completely loaded. */
+    std::atomic<uint32_t> resident;
     /** Maps the given octree file to memory for reading and rendering. */
-    octree_file(const char * filename);
-    /** Creates an octree file with the given name and size for writing. */
-    octree_file(const char * filename, uint32_t size);
+    octree_file(const char * filename, octree_loading loading = OCTREE_MAPPED);
+    /** Creates an octree file with the given name and room for size bytes of nodes for writing. 
+     * Exits if the file would exceed the limits of the file format. */
+    octree_file(const char * filename, uint64_t size);
     ~octree_file();
+    /** Appends room for size bytes to a file that is being written and returns its file offset.
+     * Note that this can move the mapping, which changes root. */
+    uint32_t extend(uint64_t size);
+    /** Changes the size of the node array of a file that is being written. 
+     * Cannot be used after extend(). Note that this can move the mapping, which changes root. */
+    void resize(uint64_t size);
+    /** Returns a pointer to the given file offset. */
+    void * at(uint32_t offset) { return (char*)map + offset; }
+    /** Returns whether the file is still being loaded by a background thread. */
+    bool loading() const { return resident < size / sizeof(octree); }
 private:
+    void * map;
+    uint32_t map_size;
+    std::thread loader;
+    std::atomic<bool> stop_loading;
+    void load();
     octree_file(octree_file &);
     octree_file& operator=(octree_file&);
 };
@@ -20,6 +20,7 @@
 #include <cassert>
 #include <algorithm>
 #include <xmmintrin.h>
+#include <smmintrin.h>
 
 #include "quadtree.h"
 #include "timing.h"
@@ -32,6 +33,10 @@ using std::min;
 
 static quadtree face;
 static octree * root;
+static const uint8_t * colors; //< Separate color array, or nullptr if the colors are stored in the nodes.
+static const uint32_t * palette; //< Palette, or nullptr if the colors are not palette indices.
+static int color_bytes; //< Size of the colors in the color array and in bricks.
+static uint32_t resident; //< Nodes below this index are loaded, see octree_file::resident.
 static int C; //< The corner that is furthest away from the camera.
 static int count, count_oct, count_quad;
 static glm::dvec3 look_dir;
@@ -66,6 +71,49 @@ static inline int movemask_epi32(__m128i v) {
     return _mm_movemask_ps(_mm_castsi128_ps(v));
 }
 
+/** Value of ref for the cells of a brick, which is added to the index of the cell. */
+static const uint32_t BRICK_CELL = 0x80000000u;
+
+/** Returns a bitmask of the cells of a brick that contain leaves, which are the non-zero bytes of its occupancy. */
+static inline int brick_cells(uint64_t occupancy) {
+    __m128i empty = _mm_cmpeq_epi8(_mm_cvtsi64_si128(occupancy), _mm_setzero_si128());
+    return ~_mm_movemask_epi8(empty) & 0xff;
+}
+
+/** Converts a stored color into a RGB color. */
+static inline uint32_t lookup(uint32_t color) {
+    return palette ? palette[color & 0xffffff] : color;
+}
+
+/** Returns the color with which the given node is drawn. */
+static inline uint32_t node_color(uint32_t octnode, uint32_t ref) {
+    if (colors) {
+        // Nodes store the index of their color, for leaves it is given by ref.
+        uint32_t index = octnode < 0xff000000u ? root[octnode].child[0] : ref;
+        switch (color_bytes) {
+            case 1:  return lookup(colors[index]);
+            case 2:  return lookup(((const uint16_t*)colors)[index]);
+            default: return ((const uint32_t*)colors)[index];
+        }
+    }
+    if (octnode >= 0xff000000u) return lookup(octnode);
+    if (ref < BRICK_CELL) return lookup(root[octnode].avgcolor);
+    // Average the leaves of a cell in a brick.
+    uint32_t cell = ref - BRICK_CELL;
+    uint32_t leaves = (root[octnode].occupancy() >> cell*8) & 0xff;
+    uint32_t r = 0, g = 0, b = 0, n = 0;
+    for (int i=0; i<8; i++) {
+        if (leaves & (1<<i)) {
+            uint32_t c = lookup(root[octnode].brick_color(cell*8 + i, color_bytes));
+            r += c>>16 & 0xff;
+            g += c>>8 & 0xff;
+            b += c & 0xff;
+            n++;
+        }
+    }
+    return (2*r+n)/(2*n)<<16 | (2*g+n)/(2*n)<<8 | (2*b+n)/(2*n);
+}
+
 // Passing mask as a template parameter, as it must be a compile time constant (for SSE4.1).
 template<int mask>
 static inline __m128i blend_epi32(__m128i a, __m128i b) {
@@ -135,6 +183,9 @@ static inline __m128i compute_frustum(__m128i dx, __m128i dy, __m128i dz) {
 /** Core of the voxel rendering algorithm.
  * @param quadnode the index of the quadnode that will be rendered to. It is assumed that it is not yet fully rendered.
  * @param octnode the index of the current octree node that is being rendered. For leaf nodes (and their 'childs') octnode will be a color and >= 0xff000000u.
+ * @param ref the index of the color of octnode. This is octnode for nodes and the position of the leaf in its parent for leaves.
+ *            For the cells of a brick, octnode is the brick and ref is BRICK_CELL plus the index of the cell.
+ *            With split colors, ref is the index in the color array for leaves and unused for nodes.
  * @param bound is the quadnode projected on the parallel plane containing the furthest corner of the current octree node.
  *              It stores the distance from this furthest corner to the (left, right, top, bottom) edge of the projected quadnode.
  * @param dx,dy,dz represent how this projection changes when traversing an edge to one of the other corners.
@@ -144,7 +195,7 @@ static inline __m128i compute_frustum(__m128i dx, __m128i dy, __m128i dz) {
  * @return true if quadtree node is rendered 
  */
 static bool traverse(
-    const int32_t quadnode, const uint32_t octnode,
+    const int32_t quadnode, const uint32_t octnode, const uint32_t ref,
     const __m128i bound, const __m128i dx, const __m128i dy, const __m128i dz, const __m128i frustum,
     const __m128i pos, const int depth
 ){    
@@ -154,7 +205,7 @@ static bool traverse(
     if (depth>=0 && delta < 2<<SCENE_DEPTH) {
         __m128i octant = _mm_cmplt_epi32(pos, _mm_setzero_si128());
         int furthest = movemask_epi32(_mm_shuffle_epi32(octant, 0xc6));
-        if (octnode < 0xff000000) {
+        if (octnode < 0xff000000 && !root[octnode].is_brick()) {
             // Traverse octree
             FOR_k_IS_0_TO_7({
                 int i = furthest^k;
@@ -166,7 +217,46 @@ static bool traverse(
                     if ((C^i)&DZ) new_bound = _mm_add_epi32(new_bound,dz);
                     if (!movemask_epi32(_mm_cmplt_epi32(new_bound, frustum))) { // frustum occlusion
                         count_oct++;
-                        if (traverse(quadnode, root[octnode].child[j], new_bound, dx, dy, dz, frustum, _mm_add_epi32(pos, _mm_slli_epi32(DELTA[i], depth)), depth-1)) return true;
+                        uint32_t child;
+                        uint32_t child_ref;
+                        if (!colors) {
+                            child = root[octnode].child[j];
+                            child_ref = child < 0xff000000u ? child : octnode + 1 + j;
+                        } else if (root[octnode].avgcolor == OCTREE_SPLIT_LEAVES) {
+                            // The leaves are not stored, their colors follow the color of their parent.
+                            child = 0xff000000u;
+                            child_ref = root[octnode].child[0] + 1 + j;
+                        } else {
+                            child = child_ref = root[octnode].child[1 + j];
+                        }
+                        if (child >= resident && child < 0xff000000u) {
+                            // Not yet loaded, draw it as a leaf with the color of its parent.
+                            child = 0xff000000u | root[octnode].avgcolor;
+                            child_ref = colors ? root[octnode].child[0] : octnode;
+                        }
+                        if (traverse(quadnode, child, child_ref, new_bound, dx, dy, dz, frustum, _mm_add_epi32(pos, _mm_slli_epi32(DELTA[i], depth)), depth-1)) return true;
+                    }
+                }
+            });
+        } else if (octnode < 0xff000000) {
+            // Traverse brick, either its cells or the leaves of one of its cells.
+            uint64_t occupancy = root[octnode].occupancy();
+            int mask = (ref < BRICK_CELL) ? brick_cells(occupancy) : (occupancy >> (ref - BRICK_CELL)*8) & 0xff;
+            FOR_k_IS_0_TO_7({
+                int i = furthest^k;
+                if (mask & (1<<i)) {
+                    __m128i new_bound = _mm_slli_epi32(bound, 1);
+                    if ((C^i)&DX) new_bound = _mm_add_epi32(new_bound,dx);
+                    if ((C^i)&DY) new_bound = _mm_add_epi32(new_bound,dy);
+                    if ((C^i)&DZ) new_bound = _mm_add_epi32(new_bound,dz);
+                    if (!movemask_epi32(_mm_cmplt_epi32(new_bound, frustum))) { // frustum occlusion
+                        count_oct++;
+                        uint32_t child = octnode;
+                        uint32_t child_ref = BRICK_CELL + i;
+                        if (ref >= BRICK_CELL) {
+                            child = child_ref = 0xff000000u | root[octnode].brick_color((ref - BRICK_CELL)*8 + i, color_bytes);
+                        }
+                        if (traverse(quadnode, child, child_ref, new_bound, dx, dy, dz, frustum, _mm_add_epi32(pos, _mm_slli_epi32(DELTA[i], depth)), depth-1)) return true;
                     }
                 }
             });
@@ -180,7 +270,7 @@ static bool traverse(
                 if ((C^i)&DZ) new_bound = _mm_add_epi32(new_bound,dz);
                 if (!movemask_epi32(_mm_cmplt_epi32(new_bound, frustum))) { // frustum occlusion
                     count_oct++;
-                    if (traverse(quadnode, octnode, new_bound, dx, dy, dz, frustum, _mm_add_epi32(pos, _mm_slli_epi32(DELTA[i], depth)), depth-1)) return true;
+                    if (traverse(quadnode, octnode, ref, new_bound, dx, dy, dz, frustum, _mm_add_epi32(pos, _mm_slli_epi32(DELTA[i], depth)), depth-1)) return true;
                 }
             });
         }
@@ -202,7 +292,7 @@ static bool traverse(
                 __m128i new_frustum = compute_frustum(new_dx, new_dy, new_dz);
                 if (!movemask_epi32(_mm_cmplt_epi32(new_bound, new_frustum))) { // frustum occlusion
                     if (quadnode<quadtree::M) {
-                        if (traverse(quadnode*4+i, octnode, new_bound, new_dx, new_dy, new_dz, new_frustum, pos, depth)) {
+                        if (traverse(quadnode*4+i, octnode, ref, new_bound, new_dx, new_dy, new_dz, new_frustum, pos, depth)) {
                             mask &= ~(1<<i); 
                         }
                         count_quad++;
@@ -210,7 +300,8 @@ static bool traverse(
                         glm::dvec3 dpos(extract_epi32<0>(pos), extract_epi32<1>(pos), extract_epi32<2>(pos));
                         double depth = glm::dot(dpos, look_dir);
                         uint32_t udepth(depth);
-                        uint32_t color = (octnode < 0xff000000u) ? root[octnode].avgcolor : octnode;
+                        // The color array is only accessed here, such that the traversal does not need to load it.
+                        uint32_t color = node_color(octnode, ref);
                         face.draw(quadnode*4+i, color, udepth); // Rendering
                         mask &= ~(1<<i);
                     }
@@ -255,6 +346,11 @@ void octree_draw(octree_file* file, surface surf, view_pane view, glm::dvec3 pos
 #endif
 
     root = file->root;
+    colors = file->colors;
+    palette = file->palette;
+    color_bytes = file->header.color_bytes();
+    resident = file->resident;
+    if (resident == 0) return;
     face.surf = surf;
     look_dir = glm::dvec3(0,0,1) * orientation;
     
@@ -289,7 +385,7 @@ void octree_draw(octree_file* file, surface surf, view_pane view, glm::dvec3 pos
     __m128i new_dy = _mm_sub_epi32(bounds[C^DY], bounds[C]);
     __m128i new_dz = _mm_sub_epi32(bounds[C^DZ], bounds[C]);
     __m128i new_frustum = compute_frustum(new_dx, new_dy, new_dz);
-    traverse(-1, 0, bounds[C], new_dx, new_dy, new_dz, new_frustum, pos, SCENE_DEPTH-1);
+    traverse(-1, 0, 0, bounds[C], new_dx, new_dy, new_dz, new_frustum, pos, SCENE_DEPTH-1);
     timer_query = t_query.elapsed();
 
     std::printf("%7.2f | Prepare:%4.2f Query:%7.2f | Count:%10d Oct:%10d Quad:%10d\n", t_global.elapsed(), timer_prepare, timer_query, count, count_oct, count_quad);
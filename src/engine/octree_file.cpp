@@ -18,7 +18,9 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <cassert>
+#include <algorithm>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
@@ -27,33 +29,235 @@
 
 #define static_assert(test, message) typedef char static_assert__##message[(test)?1:-1]
 static_assert(sizeof(octree)==4,octree_wrong_size);
+static_assert(sizeof(octree_header)==512,octree_header_wrong_size);
 
-octree_file::octree_file(const char* filename) : write(false) {
+/** Computes the FNV-1a hash of the given nodes. */
+static uint32_t checksum(const octree * root, uint32_t nodes) {
+  const uint8_t * data = (const uint8_t*)root;
+  uint32_t hash = 2166136261u;
+  for (uint32_t i=0; i<nodes*sizeof(octree); i++) {
+    hash = (hash ^ data[i]) * 16777619u;
+  }
+  return hash;
+}
+
+void octree_header::init(uint32_t size) {
+  memset(this, 0, sizeof(*this));
+  magic = OCTREE_MAGIC;
+  version = 1;
+  header_size = sizeof(octree_header);
+  node_size = size;
+  top_repeat_layer = top_data_layer = bottom_layer = -1;
+  repeat_mask = 7;
+  for (int i=0; i<3; i++) {
+    bounds_min[i] = ~0u;
+    bounds_max[i] = 0;
+  }
+  checksum_size = std::min(size / (uint32_t)sizeof(octree), CHECKSUM_NODES);
+}
+
+/** Reads the pages of the given memory range, such that it is resident afterwards. */
+static void touch(const void * data, size_t length) {
+  const size_t page = 4096;
+  uintptr_t start = (uintptr_t)data & ~(page - 1);
+  uintptr_t end = (uintptr_t)data + length;
+  madvise((void*)start, end - start, MADV_WILLNEED);
+  for (uintptr_t p = start; p < end; p += page) {
+    (void)*(volatile const char*)p;
+  }
+}
+
+octree_file::octree_file(const char* filename, octree_loading loading) : write(false), stop_loading(false) {
   fd = open(filename, O_RDONLY);
   if (fd == -1) {perror("Could not open file"); exit(1);}
-  size = lseek(fd, 0, SEEK_END);
-  assert(size % sizeof(octree) == 0);
+  map_size = lseek(fd, 0, SEEK_END);
   // It is unclear whether using MAP_PRIVATE or MAP_SHARED for mmap makes any difference.
-  root = (octree*)mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
-  if (root == MAP_FAILED) {perror("Could not map octree file to memory for reading"); exit(1);} 
+  map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+  if (map == MAP_FAILED) {perror("Could not map octree file to memory for reading"); exit(1);} 
+  
+  if (map_size >= sizeof(octree_header) && *(uint32_t*)map == OCTREE_MAGIC) {
+    memcpy(&header, map, sizeof(octree_header));
+    if (header.version > OCTREE_VERSION) {
+      fprintf(stderr, "Octree file '%s' has version %u, which is newer than the supported version %u.\n", filename, header.version, OCTREE_VERSION); 
+      exit(1);
+    }
+    if (header.flags & ~OCTREE_KNOWN_FLAGS) {
+      fprintf(stderr, "Octree file '%s' uses unsupported format flags 0x%x.\n", filename, header.flags & ~OCTREE_KNOWN_FLAGS); 
+      exit(1);
+    }
+    if ((header.flags & OCTREE_SPLIT_COLORS) && (header.flags & OCTREE_BRICKS)) {
+      fprintf(stderr, "Octree file '%s' combines split colors with bricks, which is not supported.\n", filename); 
+      exit(1);
+    }
+    if ((header.flags & OCTREE_SPLIT_COLORS) && header.version < 2) {
+      fprintf(stderr, "Octree file '%s' uses the split color layout of version 1, which is no longer supported.\n", filename); 
+      exit(1);
+    }
+    if (header.header_size < sizeof(octree_header) || header.header_size % sizeof(octree) || 
+        header.node_size % sizeof(octree) || (uint64_t)header.header_size + header.node_size > map_size) {
+      fprintf(stderr, "Octree file '%s' is truncated or has a corrupt header.\n", filename); 
+      exit(1);
+    }
+    size = header.node_size;
+    root = (octree*)at(header.header_size);
+    if (header.checksum_size > size / sizeof(octree) || checksum(root, header.checksum_size) != header.checksum) {
+      fprintf(stderr, "Octree file '%s' is corrupt (checksum mismatch).\n", filename); 
+      exit(1);
+    }
+    colors = nullptr;
+    if (header.flags & OCTREE_SPLIT_COLORS) {
+      if ((uint64_t)header.color_offset + (uint64_t)header.color_count * header.color_bytes() > map_size) {
+        fprintf(stderr, "Octree file '%s' has a truncated color array.\n", filename); 
+        exit(1);
+      }
+      colors = (uint8_t*)at(header.color_offset);
+    }
+    palette = nullptr;
+    if (header.flags & OCTREE_PALETTE) {
+      if (header.palette_offset % sizeof(uint32_t) || header.palette_size == 0 || header.palette_size > (1<<16) || 
+          (uint64_t)header.palette_offset + header.palette_size * sizeof(uint32_t) > map_size) {
+        fprintf(stderr, "Octree file '%s' has a truncated palette.\n", filename); 
+        exit(1);
+      }
+      palette = (uint32_t*)at(header.palette_offset);
+    }
+  } else {
+    // Legacy file, which consists of only the node array.
+    size = map_size;
+    assert(size % sizeof(octree) == 0);
+    root = (octree*)map;
+    colors = nullptr;
+    palette = nullptr;
+    header.init(size);
+    header.magic = 0;
+    header.version = 0;
+    header.header_size = 0;
+  }
+  
+  uint32_t nodes = size / sizeof(octree);
+  if (loading == OCTREE_PROGRESSIVE && header.checksum_size < nodes) {
+    if (header.header_size == 0) {
+      // Legacy files have no checksum, hence the nodes that it would cover are read here.
+      touch(root, header.checksum_size * sizeof(octree));
+    }
+    // The nodes covered by the checksum have been read.
+    resident = header.checksum_size > OCTREE_MAX_NODE_SIZE ? header.checksum_size - OCTREE_MAX_NODE_SIZE : 0;
+    loader = std::thread(&octree_file::load, this);
+  } else {
+    resident = nodes;
+  }
+}
+
+/** Loads the node array front to back, together with the corresponding part of the color array.
+ * Runs on the loader thread.
+ */
+void octree_file::load() {
+  const uint32_t CHUNK = 1<<18; // Number of nodes per step.
+  uint32_t nodes = size / sizeof(octree);
+  uint32_t bytes = header.color_bytes();
+  if (palette) {
+    touch(palette, header.palette_size * sizeof(uint32_t));
+  }
+  for (uint32_t start = 0; start < nodes && !stop_loading; start += CHUNK) {
+    uint32_t end = std::min(start + CHUNK, nodes);
+    touch(root + start, (end - start) * sizeof(octree));
+    if (colors) {
+      // The colors are stored in the order of the nodes, hence the part of the color array of these nodes is estimated.
+      size_t color_start = (uint64_t)start * header.color_count / nodes;
+      size_t color_end = (uint64_t)end * header.color_count / nodes;
+      touch(colors + color_start * bytes, (color_end - color_start) * bytes);
+    }
+    resident = end < nodes ? end - OCTREE_MAX_NODE_SIZE : nodes;
+  }
+}
+
+/** Exits if a file of the given number of bytes, including its header, cannot be stored in the file format. */
+static void check_filesize(uint64_t bytes) {
+  if (bytes - sizeof(octree_header) > OCTREE_MAX_FILESIZE) {
+    fprintf(stderr, "Octree file of %lu bytes exceeds the 4GiB limit of the file format.\n", bytes);
+    exit(1);
+  }
 }
 
-octree_file::octree_file(const char* filename, uint32_t size) : write(true), size(size) {
+octree_file::octree_file(const char* filename, uint64_t size) : write(true), size(size), stop_loading(false) {
+  check_filesize(sizeof(octree_header) + size);
   fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
   if (fd == -1) {perror("Could not open/creat file"); exit(1);}
-  int ret = ftruncate(fd, size);
-  if (ret) {perror("Could not reserve diskspace"); exit(1);}
   assert(size % sizeof(octree) == 0);
+  header.init(size);
+  map_size = header.header_size + size;
+  int ret = ftruncate(fd, map_size);
+  if (ret) {perror("Could not reserve diskspace"); exit(1);}
   // This requires MAP_SHARED for mmap as changes must be written to disk
-  root = (octree*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-  if (root == MAP_FAILED) {perror("Could not map octree file to memory for writing"); exit(1);} 
+  map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {perror("Could not map octree file to memory for writing"); exit(1);} 
+  root = (octree*)at(header.header_size);
+  colors = nullptr;
+  palette = nullptr;
+  resident = size / sizeof(octree);
+}
+
+void octree_file::resize(uint64_t size) {
+  assert(write);
+  check_filesize(header.header_size + size);
+  assert(size % sizeof(octree) == 0);
+  assert(map_size == header.header_size + this->size);
+  uint32_t new_size = header.header_size + size;
+  if (new_size > map_size) {
+    int ret = ftruncate(fd, new_size);
+    if (ret) {perror("Could not reserve diskspace"); exit(1);}
+  }
+  map = mremap(map, map_size, new_size, MREMAP_MAYMOVE);
+  if (map == MAP_FAILED) {perror("Could not resize octree file mapping"); exit(1);} 
+  if (new_size < map_size) {
+    int ret = ftruncate(fd, new_size);
+    if (ret) {perror("Could not truncate octree file"); exit(1);}
+  }
+  map_size = new_size;
+  this->size = size;
+  header.node_size = size;
+  header.checksum_size = std::min<uint64_t>(size / sizeof(octree), octree_header::CHECKSUM_NODES);
+  root = (octree*)at(header.header_size);
+  resident = size / sizeof(octree);
+}
+
+uint32_t octree_file::extend(uint64_t size) {
+  assert(write);
+  check_filesize(map_size + size + sizeof(octree));
+  uint32_t offset = map_size;
+  size = (size + sizeof(octree) - 1) & ~(sizeof(octree) - 1);
+  int ret = ftruncate(fd, map_size + size);
+  if (ret) {perror("Could not reserve diskspace"); exit(1);}
+  map = mremap(map, map_size, map_size + size, MREMAP_MAYMOVE);
+  if (map == MAP_FAILED) {perror("Could not extend octree file mapping"); exit(1);} 
+  map_size += size;
+  root = (octree*)at(header.header_size);
+  if (colors) {
+    colors = (uint8_t*)at(header.color_offset);
+  }
+  if (palette) {
+    palette = (uint32_t*)at(header.palette_offset);
+  }
+  return offset;
 }
 
 octree_file::~octree_file() {
-  if (root!=MAP_FAILED)
-    munmap(root, size);
+  if (loader.joinable()) {
+    stop_loading = true;
+    loader.join();
+  }
+  if (map!=MAP_FAILED) {
+    if (write) {
+      header.checksum = checksum(root, header.checksum_size);
+      memcpy(map, &header, sizeof(octree_header));
+    }
+    munmap(map, map_size);
+  }
   if (fd!=-1)
     close(fd);
 }
 
+const int octree_header::LAYERS;
+const uint32_t octree_header::CHECKSUM_NODES;
+
 // kate: space-indent on; indent-width 2; mixedindent off; indent-mode cstyle; 
@@ -0,0 +1,51 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013,2014  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+#include <stdint.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+/** Returns the number of threads used by parallel_ranges. 
+ * This is the number of cores, unless it is set with the environment variable VOXEL_THREADS. */
+static inline int thread_count() {
+    const char * env = getenv("VOXEL_THREADS");
+    int n = env ? atoi(env) : std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+}
+
+/** Splits [0, n) into thread_count() contiguous ranges and calls f(thread, begin, end) for each of them in parallel.
+ * The ranges only depend on n, such that consecutive calls with the same n assign the same range to each thread.
+ * Returns when all calls have completed.
+ */
+template<class F>
+void parallel_ranges(uint64_t n, F f) {
+    int threads = thread_count();
+    std::vector<std::thread> pool;
+    for (int i=1; i<threads; i++) {
+        pool.push_back(std::thread(f, i, n*i/threads, n*(i+1)/threads));
+    }
+    f(0, 0, n/threads);
+    for (std::thread &t : pool) {
+        t.join();
+    }
+}
+
+#endif
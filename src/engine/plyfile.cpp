@@ -0,0 +1,175 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <algorithm>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "plyfile.h"
+
+static const char * type_names[][2] = {
+    {"char", "int8"}, {"uchar", "uint8"}, {"short", "int16"}, {"ushort", "uint16"},
+    {"int", "int32"}, {"uint", "uint32"}, {"float", "float32"}, {"double", "float64"},
+};
+static const uint32_t type_sizes[] = {1, 1, 2, 2, 4, 4, 4, 8};
+static const char * property_names[][2] = {
+    {"x", "x"}, {"y", "y"}, {"z", "z"}, {"red", "diffuse_red"}, {"green", "diffuse_green"}, {"blue", "diffuse_blue"},
+};
+
+static int parse_type(const char * name) {
+    for (int i=0; i<8; i++) {
+        if (strcmp(name, type_names[i][0]) == 0 || strcmp(name, type_names[i][1]) == 0) return i;
+    }
+    fprintf(stderr, "Unknown PLY property type '%s'.\n", name);
+    exit(1);
+}
+
+template<class T>
+static inline T read_le(const uint8_t * p) {
+    T v;
+    memcpy(&v, p, sizeof(T));
+    return v;
+}
+
+static inline double read_property(const uint8_t * p, plyfile::type type) {
+    switch (type) {
+        case plyfile::INT8:    return (int8_t)p[0];
+        case plyfile::UINT8:   return p[0];
+        case plyfile::INT16:   return read_le<int16_t>(p);
+        case plyfile::UINT16:  return read_le<uint16_t>(p);
+        case plyfile::INT32:   return read_le<int32_t>(p);
+        case plyfile::UINT32:  return read_le<uint32_t>(p);
+        case plyfile::FLOAT32: return read_le<float>(p);
+        case plyfile::FLOAT64: return read_le<double>(p);
+    }
+    return 0;
+}
+
+/** Converts a color channel to 8 bits, scaling 16 bit integers and floats in [0,1]. */
+static inline uint32_t read_channel(const uint8_t * p, plyfile::type type) {
+    double v = read_property(p, type);
+    if (type == plyfile::UINT16) v /= 257;
+    else if (type == plyfile::FLOAT32 || type == plyfile::FLOAT64) v *= 255;
+    return v <= 0 ? 0 : v >= 255 ? 255 : (uint32_t)(v + 0.5);
+}
+
+plyfile::plyfile(const char* filename) {
+    fd = open(filename, O_RDONLY);
+    if (fd == -1) {perror("Could not open file"); exit(1);}
+    size = lseek(fd, 0, SEEK_END);
+    data = (const uint8_t*)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (size == 0 || data == MAP_FAILED) {perror("Could not map file to memory"); exit(1);}
+
+    // Parse the header, which consists of lines of text.
+    const char * text = (const char*)data;
+    const char * end = text + size;
+    if (size < 4 || memcmp(text, "ply", 3) != 0) {fprintf(stderr, "File is not a PLY file.\n"); exit(1);}
+    int found = 0;
+    int elements = 0;
+    bool vertex = false;
+    length = 0;
+    stride = 0;
+    for (const char * line = text; ; ) {
+        const char * eol = (const char*)memchr(line, '\n', end - line);
+        if (!eol) {fprintf(stderr, "PLY header is not terminated.\n"); exit(1);}
+        std::string s(line, eol - line);
+        if (!s.empty() && s.back() == '\r') s.pop_back();
+        line = eol + 1;
+        char word[3][64];
+        unsigned long long count;
+        if (s == "end_header") {
+            vertex_offset = line - text;
+            break;
+        } else if (sscanf(s.c_str(), "format %63s", word[0]) == 1) {
+            if (strcmp(word[0], "binary_little_endian") != 0) {
+                fprintf(stderr, "PLY format '%s' is not supported, only binary_little_endian.\n", word[0]);
+                exit(1);
+            }
+        } else if (sscanf(s.c_str(), "element %63s %llu", word[0], &count) == 2) {
+            vertex = elements++ == 0 && strcmp(word[0], "vertex") == 0;
+            if (vertex) length = count;
+        } else if (sscanf(s.c_str(), "property list %63s %63s %63s", word[0], word[1], word[2]) == 3) {
+            if (vertex) {fprintf(stderr, "PLY vertices with list properties are not supported.\n"); exit(1);}
+        } else if (sscanf(s.c_str(), "property %63s %63s", word[0], word[1]) == 2) {
+            if (!vertex) continue;
+            int type = parse_type(word[0]);
+            for (int i=0; i<6; i++) {
+                if (strcmp(word[1], property_names[i][0]) == 0 || strcmp(word[1], property_names[i][1]) == 0) {
+                    offset[i] = stride;
+                    types[i] = (plyfile::type)type;
+                    found |= 1<<i;
+                }
+            }
+            stride += type_sizes[type];
+        }
+    }
+    if (length == 0) {fprintf(stderr, "PLY file does not start with vertices.\n"); exit(1);}
+    if ((found & 7) != 7) {fprintf(stderr, "PLY vertices do not have x, y and z coordinates.\n"); exit(1);}
+    has_color = (found & 0x38) == 0x38;
+    if (vertex_offset + length * stride > size) {fprintf(stderr, "PLY file is truncated.\n"); exit(1);}
+    madvise((void*)data, size, MADV_SEQUENTIAL);
+}
+
+plyfile::~plyfile() {
+    if (data!=MAP_FAILED)
+        munmap((void*)data, size);
+    if (fd!=-1)
+        close(fd);
+}
+
+quantizer plyfile::bounds() const {
+    std::vector<quantizer> parts(thread_count());
+    parallel_ranges(length, [&](int thread, uint64_t begin, uint64_t end) {
+        const uint8_t * v = data + vertex_offset + begin * stride;
+        for (uint64_t i=begin; i<end; i++, v += stride) {
+            parts[thread].add(read_property(v + offset[0], types[0]),
+                              read_property(v + offset[1], types[1]),
+                              read_property(v + offset[2], types[2]));
+        }
+    });
+    quantizer q;
+    for (const quantizer &part : parts) q.add(part);
+    return q;
+}
+
+void plyfile::decode(uint64_t begin, uint64_t count, point* list, const quantizer &q) const {
+    const uint8_t * v = data + vertex_offset + begin * stride;
+    for (uint64_t i=0; i<count; i++, v += stride) {
+        uint32_t x = q.voxel(0, read_property(v + offset[0], types[0]));
+        uint32_t y = q.voxel(1, read_property(v + offset[1], types[1]));
+        uint32_t z = q.voxel(2, read_property(v + offset[2], types[2]));
+        uint32_t c = 0xffffff;
+        if (has_color) {
+            c = (read_channel(v + offset[3], types[3]) << 16) |
+                (read_channel(v + offset[4], types[4]) << 8) |
+                 read_channel(v + offset[5], types[5]);
+        }
+        list[i] = point(x, z, y, c);
+    }
+}
+
+bool is_plyfile(const char* filename) {
+    int n = strlen(filename);
+    return n >= 4 && strcasecmp(filename + n - 4, ".ply") == 0;
+}
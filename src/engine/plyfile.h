@@ -0,0 +1,55 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PLYFILE_H
+#define PLYFILE_H
+#include <stdint.h>
+
+#include "pointset.h"
+#include "ingest.h"
+
+/**
+ * Opens a point cloud in the binary little endian PLY format for reading.
+ * The vertex element must be the first element of the file. Its x, y and z properties are the coordinates,
+ * and the optional red, green and blue properties the color. Other properties are skipped.
+ * As the coordinates are real numbers, they are quantized into voxels. The PLY Z axis, which points up,
+ * is mapped to the Y axis of the engine.
+ */
+struct plyfile {
+    enum type {INT8, UINT8, INT16, UINT16, INT32, UINT32, FLOAT32, FLOAT64};
+    int32_t fd;
+    uint64_t size;      /// Number of bytes in the file.
+    const uint8_t * data;
+    uint64_t length;    /// Number of vertices in the file.
+    uint64_t vertex_offset;
+    uint32_t stride;    /// Number of bytes per vertex.
+    uint32_t offset[6]; /// Offset of x, y, z, red, green and blue within the vertex.
+    type types[6];      /// Type of x, y, z, red, green and blue.
+    bool has_color;
+    plyfile(const char * filename);
+    ~plyfile();
+    /** Computes the bounding box of the vertices in parallel. */
+    quantizer bounds() const;
+    /** Decodes the count vertices starting at begin into voxels. */
+    void decode(uint64_t begin, uint64_t count, point * list, const quantizer &q) const;
+};
+
+/** Returns whether the file name has the .ply extension. */
+bool is_plyfile(const char * filename);
+
+#endif
@@ -16,25 +16,200 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
 #include <cassert>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
+#include <vector>
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 
 #include "pointset.h"
+#include "hilbert.h"
+#include "parallel.h"
 
-pointset::pointset(const char* filename, bool write) : write(write) {
+static const uint32_t COMPACT_HEADER = 16;
+static const uint32_t COMPACT_BLOCK_HEADER = 8;
+
+bool is_compact_pointfile(const char* filename) {
+    int n = strlen(filename);
+    return n >= 4 && strcmp(filename + n - 4, ".vxc") == 0;
+}
+
+static void write_fully(int fd, const void * data, uint64_t bytes) {
+    for (uint64_t done=0; done<bytes; ) {
+        ssize_t r = write(fd, (const char*)data + done, bytes - done);
+        if (r <= 0) {perror("Error while writing to pointfile"); exit(1);}
+        done += r;
+    }
+}
+
+static void put_varint(std::vector<uint8_t> &out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back(v | 0x80);
+        v >>= 7;
+    }
+    out.push_back(v);
+}
+
+static uint64_t get_varint(const uint8_t *&in) {
+    uint64_t v = 0;
+    for (int shift=0; ; shift+=7) {
+        uint8_t b = *in++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (b < 0x80) return v;
+    }
+}
+
+/** 
+ * Appends the points to out as a single block. 
+ * The differences between the morton keys, which have 63 bits, are taken modulo 2^63 and zigzag coded, 
+ * such that small steps in either direction take few bytes. The lowest bit tells whether the upper 8 bits of the color are stored.
+ */
+static void encode_block(const point * list, uint32_t n, std::vector<uint8_t> &out) {
+    const uint64_t MASK = (1ull<<63) - 1;
+    uint32_t header[2] = {n, 0};
+    uint64_t start = out.size();
+    out.insert(out.end(), (uint8_t*)header, (uint8_t*)(header + 2));
+    uint64_t old = 0;
+    for (uint32_t i=0; i<n; i++) {
+        const point &p = list[i];
+        if ((p.x | p.y | p.z) >= (1u<<21)) {
+            fprintf(stderr, "Point (%u, %u, %u) does not fit in a compact pointset file.\n", p.x, p.y, p.z);
+            exit(1);
+        }
+        uint64_t key = morton3d(p.x, p.y, p.z);
+        int64_t delta = (int64_t)(((key - old) & MASK) << 1) >> 1;
+        uint64_t zigzag = ((uint64_t)delta << 1 ^ (uint64_t)(delta >> 63)) & MASK;
+        put_varint(out, zigzag << 1 | (p.c >= 0x1000000));
+        out.push_back(p.c);
+        out.push_back(p.c >> 8);
+        out.push_back(p.c >> 16);
+        if (p.c >= 0x1000000) out.push_back(p.c >> 24);
+        old = key;
+    }
+    header[1] = out.size() - start - COMPACT_BLOCK_HEADER;
+    memcpy(out.data() + start, header, sizeof(header));
+}
+
+static void decode_block(const uint8_t * in, uint32_t n, point * list) {
+    const uint64_t MASK = (1ull<<63) - 1;
+    uint64_t key = 0;
+    for (uint32_t i=0; i<n; i++) {
+        uint64_t v = get_varint(in);
+        uint64_t zigzag = v >> 1;
+        key = (key + ((zigzag >> 1) ^ -(zigzag & 1))) & MASK;
+        point &p = list[i];
+        morton3d_inverse(key, p.x, p.y, p.z);
+        p.c = in[0] | in[1] << 8 | in[2] << 16;
+        in += 3;
+        if (v & 1) p.c |= (uint32_t)*in++ << 24;
+    }
+}
+
+/** Encodes the points into blocks of COMPACT_BLOCK points in parallel and writes them to the file. */
+static void write_blocks(int fd, const point * list, uint64_t n) {
+    uint64_t blocks = (n + COMPACT_BLOCK - 1) / COMPACT_BLOCK;
+    std::vector<std::vector<uint8_t>> data(blocks);
+    parallel_ranges(blocks, [&](int, uint64_t begin, uint64_t end) {
+        for (uint64_t i=begin; i<end; i++) {
+            uint64_t first = i * COMPACT_BLOCK;
+            encode_block(list + first, std::min<uint64_t>(COMPACT_BLOCK, n - first), data[i]);
+        }
+    });
+    for (const std::vector<uint8_t> &d : data) {
+        write_fully(fd, d.data(), d.size());
+    }
+}
+
+static void write_header(int fd, uint64_t length) {
+    uint8_t header[COMPACT_HEADER];
+    memcpy(header, COMPACT_MAGIC, 4);
+    memcpy(header + 4, &COMPACT_BLOCK, 4);
+    memcpy(header + 8, &length, 8);
+    if (pwrite(fd, header, COMPACT_HEADER, 0) != COMPACT_HEADER) {
+        perror("Error while writing to pointfile"); exit(1);
+    }
+}
+
+static bool is_compact(int fd, uint64_t bytes) {
+    char magic[4];
+    return bytes >= COMPACT_HEADER && pread(fd, magic, 4, 0) == 4 && memcmp(magic, COMPACT_MAGIC, 4) == 0;
+}
+
+/** 
+ * Finds the blocks of a compact file, without reading their contents. Blocks without points are skipped.
+ * Block i contains the points [first[i], first[i+1]) and its contents start at offset[i].
+ * Returns the number of points.
+ */
+static uint64_t index_compact(int fd, uint64_t bytes, std::vector<uint64_t> &offset, std::vector<uint64_t> &first) {
+    uint64_t n;
+    if (pread(fd, &n, 8, 8) != 8) {perror("Could not read pointfile"); exit(1);}
+    uint64_t count = 0;
+    for (uint64_t pos = COMPACT_HEADER; pos + COMPACT_BLOCK_HEADER <= bytes; ) {
+        uint32_t header[2];
+        if (pread(fd, header, sizeof(header), pos) != sizeof(header)) {perror("Could not read pointfile"); exit(1);}
+        pos += COMPACT_BLOCK_HEADER;
+        if (pos + header[1] > bytes) break;
+        if (header[0] > 0) {
+            offset.push_back(pos);
+            first.push_back(count);
+        }
+        count += header[0];
+        pos += header[1];
+    }
+    if (count != n) {
+        fprintf(stderr, "Compact pointset file is corrupt or incomplete.\n");
+        exit(1);
+    }
+    offset.push_back(bytes);
+    first.push_back(count);
+    return n;
+}
+
+/** Decodes the blocks [b, e) of a compact file, which are stored in data, starting at offset[b]. */
+static void decode_blocks(const uint8_t * data, const std::vector<uint64_t> &offset, const std::vector<uint64_t> &first, uint64_t b, uint64_t e, point * list) {
+    parallel_ranges(e - b, [&](int, uint64_t begin, uint64_t end) {
+        for (uint64_t i=b+begin; i<b+end; i++) {
+            decode_block(data + offset[i] - offset[b], first[i+1] - first[i], list + first[i] - first[b]);
+        }
+    });
+}
+
+/** Decodes a compact file into anonymous memory. */
+static point * read_compact(int fd, uint64_t bytes, uint64_t &length) {
+    std::vector<uint64_t> offset;
+    std::vector<uint64_t> first;
+    length = index_compact(fd, bytes, offset, first);
+    uint8_t * data = (uint8_t*)mmap(NULL, bytes, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {perror("Could not map file to memory"); exit(1);} 
+    point * list = (point*)mmap(NULL, length * sizeof(point), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (list == MAP_FAILED) {perror("Could not allocate memory for points"); exit(1);} 
+    decode_blocks(data + offset[0], offset, first, 0, first.size() - 1, list);
+    munmap(data, bytes);
+    if (mprotect(list, length * sizeof(point), PROT_READ)) {perror("Could not change read/write memory protection"); exit(1);}
+    return list;
+}
+
+pointset::pointset(const char* filename, bool write) : write(write), compact(false), modified(false) {
     if (write) {
         fd = open(filename, O_RDWR | O_CREAT, 0644);
-        if (fd == -1) write = false;
+        if (fd == -1) this->write = false;
     } 
-    if (!write) {
+    if (!this->write) {
         fd = open(filename, O_RDONLY);
     }
     if (fd == -1) {perror("Could not open file"); exit(1);}
-    size = lseek(fd, 0, SEEK_END);
+    uint64_t bytes = lseek(fd, 0, SEEK_END);
+    if (is_compact(fd, bytes)) {
+        compact = true;
+        list = read_compact(fd, bytes, length);
+        size = length * sizeof(point);
+        return;
+    }
+    size = bytes;
     assert(size % sizeof(point) == 0);
     length = size / sizeof(point);
     list = (point*)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
@@ -42,6 +217,16 @@ pointset::pointset(const char* filename, bool write) : write(write) {
 }
 
 pointset::~pointset() {
+    if (compact && modified) {
+        // Encode the points again, in chunks to limit the memory used for encoding.
+        if (ftruncate(fd, 0)) {perror("Could not truncate pointfile"); exit(1);}
+        write_header(fd, length);
+        lseek(fd, COMPACT_HEADER, SEEK_SET);
+        const uint64_t CHUNK = COMPACT_BLOCK << 8;
+        for (uint64_t i=0; i<length; i+=CHUNK) {
+            write_blocks(fd, list + i, std::min<uint64_t>(CHUNK, length - i));
+        }
+    }
     if (list!=MAP_FAILED)
         munmap(list, size);
     if (fd!=-1)
@@ -58,40 +243,164 @@ void pointset::enable_write(bool flag) {
     if (write) {
         int ret = mprotect(list, size, PROT_READ | (flag?PROT_WRITE:0));
         if (ret) {perror("Could not change read/write memory protection"); exit(1);}
+        if (flag && compact) modified = true;
     } else{
         fprintf(stderr, "Not opened in write mode");
     }
 }
 
-static const int point_buffer_size = 1<<16;
-pointfile::pointfile(const char* filename) {
-    fd = open(filename, O_WRONLY | O_TRUNC | O_CREAT, 0644);
+/** Removes the points from the given length onwards. The memory stays mapped until the pointset is closed. */
+void pointset::truncate(uint64_t length) {
+    assert(write && length <= this->length);
+    this->length = length;
+    if (compact) {
+        modified = true;
+    } else if (ftruncate(fd, length * sizeof(point))) {
+        perror("Could not truncate pointfile"); exit(1);
+    }
+}
+
+pointwindow::pointwindow(const char* filename) : compact(false), begin(0), end(0), list(nullptr), block(0) {
+    fd = open(filename, O_RDONLY);
+    if (fd == -1) {perror("Could not open file"); exit(1);}
+    uint64_t bytes = lseek(fd, 0, SEEK_END);
+    if (is_compact(fd, bytes)) {
+        compact = true;
+        length = index_compact(fd, bytes, offset, first);
+    } else {
+        assert(bytes % sizeof(point) == 0);
+        length = bytes / sizeof(point);
+    }
+    if (length > 0) load();
+}
+
+pointwindow::~pointwindow() {
+    if (list && !compact)
+        munmap((void*)list, (end - begin) * sizeof(point));
+    close(fd);
+}
+
+/** Maps or decodes the window that starts at begin. */
+void pointwindow::load() {
+    if (compact) {
+        // Take as many blocks as fit in the window, but at least one.
+        uint64_t e = block + 1;
+        while (e + 1 < first.size() && first[e+1] - begin <= WINDOW) e++;
+        end = first[e];
+        std::vector<uint8_t> data(offset[e] - offset[block]);
+        for (uint64_t done=0; done<data.size(); ) {
+            ssize_t r = pread(fd, data.data() + done, data.size() - done, offset[block] + done);
+            if (r <= 0) {perror("Could not read pointfile"); exit(1);}
+            done += r;
+        }
+        decoded.resize(end - begin);
+        decode_blocks(data.data(), offset, first, block, e, decoded.data());
+        list = decoded.data();
+        block = e;
+    } else {
+        // As WINDOW is a multiple of the page size, the window starts at a page boundary.
+        end = std::min(begin + WINDOW, length);
+        void * window = mmap(NULL, (end - begin) * sizeof(point), PROT_READ, MAP_SHARED, fd, begin * sizeof(point));
+        if (window == MAP_FAILED) {perror("Could not map file to memory"); exit(1);} 
+        madvise(window, (end - begin) * sizeof(point), MADV_SEQUENTIAL);
+        list = (const point*)window;
+    }
+}
+
+/** Moves the window to the next points. Returns false if there are no more points. */
+bool pointwindow::next() {
+    if (end >= length) return false;
+    if (!compact) munmap((void*)list, (end - begin) * sizeof(point));
+    begin = end;
+    load();
+    return true;
+}
+
+static const int point_buffer_size = 1<<20;
+static const int point_buffers = 3;
+pointfile::pointfile(const char* filename) : compact(false), total(0), cnt(0), closing(false) {
+    if (strcmp(filename, "-") == 0) {
+        fd = dup(STDOUT_FILENO);
+    } else {
+        fd = open(filename, O_WRONLY | O_TRUNC | O_CREAT, 0644);
+        compact = is_compact_pointfile(filename);
+    }
     if (fd == -1) {perror("Could not open/create file"); exit(1);}
-    buffer = new point[point_buffer_size];
-    if (!buffer) {
-        fprintf(stderr, "Could not allocate larger file buffer");
+    for (int i=0; i<point_buffers; i++) {
+        available.push_back(new point[point_buffer_size]);
     }
-    cnt = 0;
+    buffer = available.back();
+    available.pop_back();
+    if (compact) {
+        // The number of points is filled in when the file is closed.
+        write_header(fd, 0);
+        lseek(fd, COMPACT_HEADER, SEEK_SET);
+    }
+    writer = std::thread(&pointfile::run, this);
 }
 
 pointfile::~pointfile() {
-    ssize_t r = write(fd, buffer, cnt * sizeof(point));
-    if (r!=cnt * (ssize_t)sizeof(point)) {
-        perror("Error while writing to pointfile"); exit(1);
+    flush();
+    {
+        std::lock_guard<std::mutex> l(lock);
+        closing = true;
     }
-    free(buffer);
+    changed.notify_all();
+    writer.join();
+    if (compact) write_header(fd, total);
+    delete[] buffer;
+    for (point * b : available) delete[] b;
     if (fd!=-1)
         close(fd);
 }
 
+/** Hands the filled part of the current buffer to the writer and continues with an available buffer. */
+void pointfile::flush() {
+    if (cnt == 0) return;
+    std::unique_lock<std::mutex> l(lock);
+    pending.push_back(std::make_pair(buffer, cnt));
+    total += cnt;
+    changed.notify_all();
+    changed.wait(l, [&]{return !available.empty();});
+    buffer = available.back();
+    available.pop_back();
+    cnt = 0;
+}
+
+/** Writes the pending buffers in the order in which they were filled, until the pointfile is closed. */
+void pointfile::run() {
+    std::unique_lock<std::mutex> l(lock);
+    while (true) {
+        changed.wait(l, [&]{return closing || !pending.empty();});
+        if (pending.empty()) return;
+        std::pair<point*, int> job = pending.front();
+        pending.pop_front();
+        l.unlock();
+        if (compact) {
+            write_blocks(fd, job.first, job.second);
+        } else {
+            write_fully(fd, job.first, job.second * sizeof(point));
+        }
+        l.lock();
+        available.push_back(job.first);
+        changed.notify_all();
+    }
+}
+
 void pointfile::add(const point& p) {
     buffer[cnt] = p;
     cnt++;
-    if (cnt >= point_buffer_size) {
-        ssize_t r = write(fd, buffer, point_buffer_size * sizeof(point));
-        if (r!=point_buffer_size * (ssize_t)sizeof(point)) {
-            perror("Error while writing to pointfile"); exit(1);
-        }
-        cnt = 0;
+    if (cnt >= point_buffer_size) flush();
+}
+
+/** Adds n points at once, which is cheaper than adding them one by one. */
+void pointfile::add_many(const point * list, uint64_t n) {
+    while (n > 0) {
+        uint64_t m = std::min<uint64_t>(n, point_buffer_size - cnt);
+        memcpy(buffer + cnt, list, m * sizeof(point));
+        cnt += m;
+        list += m;
+        n -= m;
+        if (cnt >= point_buffer_size) flush();
     }
 }
@@ -19,6 +19,11 @@
 #ifndef POINTSET_H
 #define POINTSET_H
 #include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 struct point {
     uint32_t x,y,z,c;
@@ -26,33 +31,90 @@ struct point {
     point(uint32_t x, uint32_t y, uint32_t z, uint32_t c) : x(x),y(y),z(z),c(c) {}
 };
 
+/**
+ * Pointset files are either raw arrays of points, or stored in the compact format.
+ * Compact files start with COMPACT_MAGIC, the number of points per block and the number of points,
+ * followed by blocks that start with their number of points and their size in bytes.
+ * In a block, each point is stored as the difference between its morton key and that of the previous point, 
+ * followed by its color and, if it is nonzero, the upper 8 bits of its color word.
+ * Files of points that are sorted along the hilbert curve take about 5 bytes per point in this format.
+ * The coordinates of points in compact files must be less than 2^21.
+ */
+static const char COMPACT_MAGIC[4] = {'V','X','C','1'};
+static const uint32_t COMPACT_BLOCK = 1<<12;
+
+/** Returns whether points written to the given file are stored in the compact format, which is the case if the filename ends with ".vxc". */
+bool is_compact_pointfile(const char* filename);
+
 /**
  * Opens a pointset file for reading.
  * Can also be opened in write mode for transforming or sorting the points.
  * Write access must be enabled before the data can be modified.
- * Points cannot be added or removed.
+ * Points cannot be added, but they can be removed from the end.
+ * Compact files are decoded into memory and, if they were modified, encoded again when the pointset is closed.
  */
 struct pointset {
     bool write;
-    uint32_t size; /// Number of bytes in the pointfile.
-    uint32_t length; /// Number of points in the pointfile.
+    bool compact;
+    bool modified;
+    uint64_t size; /// Number of bytes mapped into memory.
+    uint64_t length; /// Number of points in the pointfile.
     int32_t fd;
     point * list;
     pointset(const char* filename, bool write=false);
     ~pointset();
     void enable_write(bool flag);
+    void truncate(uint64_t length);
+};
+
+/**
+ * Reads a pointset file sequentially, through a window of at most WINDOW points that is mapped into memory.
+ * This is used for passes over the points that do not need the whole file, such that these also work 
+ * for files that cannot be mapped as a whole. Compact files are decoded one window at a time.
+ * The window starts at the first point. Point i is found at list[i - begin] if begin <= i < end.
+ */
+struct pointwindow {
+    static const uint64_t WINDOW = 1<<22;
+    int32_t fd;
+    bool compact;
+    uint64_t length; /// Number of points in the pointfile.
+    uint64_t begin; /// Index of the first point in the window.
+    uint64_t end; /// Index after the last point in the window.
+    const point * list;
+    std::vector<uint64_t> offset; /// Offsets of the blocks of compact files.
+    std::vector<uint64_t> first; /// Index of the first point of each block of compact files.
+    uint64_t block; /// The block that follows the window.
+    std::vector<point> decoded;
+    pointwindow(const char* filename);
+    ~pointwindow();
+    bool next();
+    void load();
 };
 
 /**
- * Opens a file for writing out points.
+ * Opens a file for writing out points. If the filename is "-", the points are written to standard output.
+ * Points are written in the compact format if the filename ends with ".vxc".
+ * The points are collected in buffers, which are written by a separate thread, such that the caller does not wait for the disk,
+ * unless all buffers are waiting to be written.
  */
 struct pointfile {
     int32_t fd;
-    point * buffer;
+    bool compact;
+    uint64_t total; /// Number of points handed to the writer.
+    point * buffer; /// The buffer that is being filled.
     int cnt;
+    std::vector<point*> available; /// Buffers that can be filled.
+    std::deque<std::pair<point*, int>> pending; /// Buffers that are waiting to be written, with their number of points.
+    bool closing;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::thread writer;
     pointfile(const char* filename);
     ~pointfile();
     void add(const point &p);
+    void add_many(const point * list, uint64_t n);
+    void flush();
+    void run();
 };
 
 #endif
@@ -0,0 +1,506 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <unordered_set>
+#include <vector>
+
+#include "octree.h"
+#include "color.h"
+#include "parallel.h"
+
+/* Generates octrees from procedural definitions. Identical subtrees are stored once,
+ * such that models with a regular structure remain small at a high resolution.
+ */
+
+/** How a model fills a cube of voxels. */
+struct shape {
+  enum kind {EMPTY, SOLID, MIXED};
+  kind fill;
+  uint32_t color;  //< Color of all voxels if the cube is solid.
+  bool shared;     //< Whether all mixed cubes in the same layer with the same key have the same content.
+  uint64_t key;
+  static shape empty() { shape s = {EMPTY, 0, false, 0}; return s; }
+  static shape solid(uint32_t color) { shape s = {SOLID, color, false, 0}; return s; }
+  static shape mixed() { shape s = {MIXED, 0, false, 0}; return s; }
+  static shape mixed(uint64_t key) { shape s = {MIXED, 0, true, key}; return s; }
+};
+
+/** A procedural model in a cube of 2^depth voxels. */
+struct model {
+  int depth;
+  virtual ~model() {}
+  /** Classifies the cube of 2^k voxels at (x, y, z), with k > 0. */
+  virtual shape classify(int k, uint32_t x, uint32_t y, uint32_t z) const = 0;
+  /** Returns whether the voxel at (x, y, z) is filled, and its color. */
+  virtual bool voxel(uint32_t x, uint32_t y, uint32_t z, uint32_t &color) const = 0;
+};
+
+/** A Menger sponge that is subdivided into 4x4x4 instead of 3x3x3 cubes, which fits the octree.
+ * A cube is removed if it is in the middle two cubes along at least two axes.
+ * Hence all remaining cubes of the same size have the same content.
+ */
+struct sponge : model {
+  static bool middle(uint32_t v, int digit) {
+    uint32_t d = (v >> 2*digit) & 3;
+    return d == 1 || d == 2;
+  }
+  /** Checks whether the cube is removed by one of its digits at or above position k. */
+  bool removed(int k, uint32_t x, uint32_t y, uint32_t z) const {
+    for (int digit = (k+1)/2; 2*digit < depth; digit++) {
+      if (middle(x, digit) + middle(y, digit) + middle(z, digit) >= 2) return true;
+    }
+    return false;
+  }
+  shape classify(int k, uint32_t x, uint32_t y, uint32_t z) const {
+    if (removed(k, x, y, z)) return shape::empty();
+    // If k is odd, the upper bit of the lowest digit is known, which determines whether the removed cubes are
+    // in the upper or lower half of the cube.
+    uint64_t key = k&1 ? ((x>>k)&1)<<2 | ((y>>k)&1)<<1 | ((z>>k)&1) : 0;
+    return shape::mixed(key);
+  }
+  bool voxel(uint32_t x, uint32_t y, uint32_t z, uint32_t &color) const {
+    if (removed(0, x, y, z)) return false;
+    color = 0x404040 + (x&3)*0x300000 + (y&3)*0x3000 + (z&3)*0x30;
+    return true;
+  }
+};
+
+/** A model defined by a signed distance function, which is negative inside and has a gradient of at most 1.
+ * The interior is solid, such that cubes far enough inside are shared. Voxels at the surface are colored by their
+ * normal, the hidden voxels inside are grey.
+ */
+struct distance_model : model {
+  static const uint32_t INTERIOR = 0x808080;
+  /** Returns the distance in voxels to the surface of the model at the point (x, y, z). */
+  virtual double distance(double x, double y, double z) const = 0;
+  shape classify(int k, uint32_t x, uint32_t y, uint32_t z) const {
+    double half = ldexp(1, k-1);
+    double d = distance(x + half, y + half, z + half);
+    double r = half * sqrt(3.);
+    if (d > r) return shape::empty();
+    // The voxels next to the cube are inside as well, hence the cube is not visible.
+    if (d < -r - 1) return shape::solid(INTERIOR);
+    return shape::mixed();
+  }
+  bool voxel(uint32_t x, uint32_t y, uint32_t z, uint32_t &color) const {
+    double cx = x + 0.5, cy = y + 0.5, cz = z + 0.5;
+    double d = distance(cx, cy, cz);
+    if (d > 0) return false;
+    if (d < -1) {
+      color = INTERIOR;
+      return true;
+    }
+    double nx = distance(cx + 0.5, cy, cz) - distance(cx - 0.5, cy, cz);
+    double ny = distance(cx, cy + 0.5, cz) - distance(cx, cy - 0.5, cz);
+    double nz = distance(cx, cy, cz + 0.5) - distance(cx, cy, cz - 0.5);
+    double n = sqrt(nx*nx + ny*ny + nz*nz);
+    if (n == 0) n = 1;
+    color = (uint32_t)(127.5 + 127*nx/n) << 16 | (uint32_t)(127.5 + 127*ny/n) << 8 | (uint32_t)(127.5 + 127*nz/n);
+    return true;
+  }
+};
+
+struct sphere : distance_model {
+  double distance(double x, double y, double z) const {
+    double c = ldexp(1, depth-1);
+    double dx = x - c, dy = y - c, dz = z - c;
+    return sqrt(dx*dx + dy*dy + dz*dz) - 0.45 * ldexp(1, depth);
+  }
+};
+
+struct torus : distance_model {
+  double distance(double x, double y, double z) const {
+    double c = ldexp(1, depth-1);
+    double dx = x - c, dy = y - c, dz = z - c;
+    double q = sqrt(dx*dx + dz*dz) - 0.3 * ldexp(1, depth);
+    return sqrt(q*q + dy*dy) - 0.12 * ldexp(1, depth);
+  }
+};
+
+/** Terrain with a height given by fractal value noise. The lattice of every octave is aligned with the octree,
+ * such that the height in a square of columns can be bounded by interpolating its corners.
+ */
+struct noise_terrain : model {
+  uint32_t seed;
+  static const int OCTAVES = 8;
+  /** Returns a pseudo random value in [-1, 1] for a lattice point. */
+  double lattice(int octave, uint32_t i, uint32_t j) const {
+    uint32_t h = seed ^ (i * 0x8da6b343u) ^ (j * 0xd8163841u) ^ (octave * 0xcb1ab31fu);
+    h ^= h >> 16; h *= 0x7feb352du; h ^= h >> 15; h *= 0x846ca68bu; h ^= h >> 16;
+    return h / 2147483647.5 - 1;
+  }
+  int spacing(int octave) const { return std::max(depth - 2 - octave, 0); }
+  double amplitude(int octave) const { return 0.25 * ldexp(1, depth) * ldexp(1, -octave-1); }
+  double octave_value(int octave, double x, double z) const {
+    int s = spacing(octave);
+    double fx = ldexp(x, -s), fz = ldexp(z, -s);
+    uint32_t i = floor(fx), j = floor(fz);
+    double u = fx - i, v = fz - j;
+    return amplitude(octave) * (
+      (lattice(octave, i, j)   * (1-u) + lattice(octave, i+1, j)   * u) * (1-v) +
+      (lattice(octave, i, j+1) * (1-u) + lattice(octave, i+1, j+1) * u) * v);
+  }
+  /** Returns the height at the center of the column. */
+  double height(uint32_t x, uint32_t z) const {
+    // The voxels of a column are evaluated close together, hence recently computed heights are kept.
+    struct cached { const noise_terrain * terrain; uint32_t x, z; double h; };
+    static thread_local cached cache[256];
+    cached &c = cache[(x&15)<<4 | (z&15)];
+    if (c.terrain != this || c.x != x || c.z != z) {
+      c.terrain = this; c.x = x; c.z = z;
+      c.h = 0.4 * ldexp(1, depth);
+      for (int o=0; o<OCTAVES; o++) c.h += octave_value(o, x + 0.5, z + 0.5);
+    }
+    return c.h;
+  }
+  shape classify(int k, uint32_t x, uint32_t y, uint32_t z) const {
+    // Evaluating the voxels of the smallest cubes is cheaper than bounding their height.
+    if (k == 1) return shape::mixed();
+    // Bound the height of the columns, using that bilinear interpolation within a lattice cell is bounded by the
+    // values at the corners of the square, if the square lies within the cell.
+    double lo = 0.4 * ldexp(1, depth), hi = lo;
+    double x0 = x + 0.5, x1 = x + ldexp(1, k) - 0.5;
+    double z0 = z + 0.5, z1 = z + ldexp(1, k) - 0.5;
+    for (int o=0; o<OCTAVES; o++) {
+      if (spacing(o) >= k) {
+        double v[4] = {octave_value(o, x0, z0), octave_value(o, x1, z0), octave_value(o, x0, z1), octave_value(o, x1, z1)};
+        lo += *std::min_element(v, v+4);
+        hi += *std::max_element(v, v+4);
+      } else {
+        lo -= amplitude(o);
+        hi += amplitude(o);
+      }
+    }
+    if (y > hi) return shape::empty();
+    if (y + ldexp(1, k) <= lo) return shape::solid(0x604020);
+    return shape::mixed();
+  }
+  bool voxel(uint32_t x, uint32_t y, uint32_t z, uint32_t &color) const {
+    double h = height(x, z);
+    if (y > h) return false;
+    double f = y * 1.0 / ldexp(1, depth);
+    if (y + 1 <= h) color = 0x604020;      // Below the surface.
+    else if (f < 0.3) color = 0x3060c0;    // Water
+    else if (f < 0.45) color = 0x40a040;   // Grass
+    else if (f < 0.6) color = 0x808070;    // Rock
+    else color = 0xf0f0f0;                 // Snow
+    return true;
+  }
+};
+
+/** Sum of the colors of a number of leaves, used to compute average colors as in build_db.
+ * As subtrees are shared, the number of leaves can exceed 2^56, hence 128 bit sums are used. */
+typedef basic_color_sum<unsigned __int128> leaf_sum;
+
+/** The distinct nodes of a layer. A node's child array contains the ordinals of its children in the layer below,
+ * or leaves. Nodes are interned, hence identical subtrees are stored once. */
+struct node_table {
+  std::vector<uint32_t> words;  //< The nodes, one after another.
+  std::vector<uint32_t> offset; //< Position of each node in words.
+  std::vector<leaf_sum> sums;
+  struct node_hash {
+    const node_table * table;
+    size_t operator()(uint32_t ordinal) const {
+      const uint32_t * node = &table->words[table->offset[ordinal]];
+      uint64_t h = 14695981039346656037ull;
+      for (uint32_t i=0; i<=(uint32_t)popcount(node[0]>>24); i++) h = (h ^ node[i]) * 1099511628211ull;
+      return h;
+    }
+  };
+  struct node_equal {
+    const node_table * table;
+    bool operator()(uint32_t a, uint32_t b) const {
+      const uint32_t * p = &table->words[table->offset[a]];
+      const uint32_t * q = &table->words[table->offset[b]];
+      return memcmp(p, q, (1 + popcount(p[0]>>24)) * sizeof(uint32_t)) == 0;
+    }
+  };
+  std::unordered_set<uint32_t, node_hash, node_equal> index;
+  node_table() : index(16, node_hash{this}, node_equal{this}) {}
+  /** Adds the node and returns its ordinal, which is that of an identical node if there is one. */
+  uint32_t add(const uint32_t * node, const leaf_sum &sum) {
+    uint32_t ordinal = offset.size();
+    offset.push_back(words.size());
+    words.insert(words.end(), node, node + 1 + popcount(node[0]>>24));
+    auto r = index.insert(ordinal);
+    if (!r.second) {
+      words.resize(offset.back());
+      offset.pop_back();
+      return *r.first;
+    }
+    sums.push_back(sum);
+    return ordinal;
+  }
+  uint32_t size() const { return offset.size(); }
+private:
+  node_table(const node_table&);
+};
+typedef std::vector<std::unique_ptr<node_table>> layer_tables;
+
+/** A child array entry, which is an ordinal in the layer below or a leaf. */
+struct entry {
+  bool present;
+  uint32_t value;
+  leaf_sum sum;
+  entry() : present(false), value(0) {}
+  entry(uint32_t value, const leaf_sum &sum) : present(true), value(value), sum(sum) {}
+};
+
+/** Interns a node with the given children in layer k, and returns its entry, or an empty entry if it has no children. */
+static entry add_node(layer_tables &layers, int k, const entry children[8]) {
+  uint32_t node[9];
+  uint32_t bitmask = 0;
+  uint32_t n = 1;
+  leaf_sum sum;
+  for (int i=0; i<8; i++) {
+    if (children[i].present) {
+      bitmask |= 1<<i;
+      sum += children[i].sum;
+      node[n++] = children[i].value;
+    }
+  }
+  if (!bitmask) return entry();
+  node[0] = bitmask<<24 | sum.color();
+  uint32_t ordinal = layers[k]->add(node, sum);
+  return entry(ordinal, layers[k]->sums[ordinal]);
+}
+
+/** Evaluates the model top-down, creating the nodes in the given tables.
+ * Solid cubes and shared mixed cubes are evaluated once per layer and key. */
+struct evaluator {
+  const model &m;
+  layer_tables &layers;
+  std::vector<std::map<std::pair<int, uint64_t>, entry>> memo;
+  /** Called for the cubes in the layer at which evaluation stops, if any. */
+  std::function<entry(uint32_t, uint32_t, uint32_t)> stop;
+  int stop_layer;
+  evaluator(const model &m, layer_tables &layers, int stop_layer = -1) : m(m), layers(layers), memo(layers.size()), stop_layer(stop_layer) {}
+
+  entry solid(int k, uint32_t color) {
+    if (k == 0) return entry(0xff000000u | color, leaf_sum(color));
+    entry &e = memo[k][std::make_pair(1, (uint64_t)color)];
+    if (!e.present) {
+      entry child = solid(k-1, color);
+      entry children[8] = {child, child, child, child, child, child, child, child};
+      e = add_node(layers, k, children);
+    }
+    return e;
+  }
+
+  entry build(int k, uint32_t x, uint32_t y, uint32_t z) {
+    if (k == 0) {
+      uint32_t color;
+      if (!m.voxel(x, y, z, color)) return entry();
+      return entry(0xff000000u | color, leaf_sum(color));
+    }
+    shape s = m.classify(k, x, y, z);
+    if (s.fill == shape::EMPTY) return entry();
+    if (s.fill == shape::SOLID) return solid(k, s.color);
+    if (k == stop_layer) return stop(x, y, z);
+    std::pair<int, uint64_t> key(2, s.key);
+    if (s.shared) {
+      auto it = memo[k].find(key);
+      if (it != memo[k].end()) return it->second;
+    }
+    uint32_t half = 1<<(k-1);
+    entry children[8];
+    for (int i=0; i<8; i++) {
+      children[i] = build(k-1, x + (i&4?half:0), y + (i&2?half:0), z + (i&1?half:0));
+    }
+    entry e = add_node(layers, k, children);
+    if (s.shared) memo[k][key] = e;
+    return e;
+  }
+};
+
+static layer_tables make_tables(int layers) {
+  layer_tables r;
+  for (int k=0; k<=layers; k++) r.push_back(std::unique_ptr<node_table>(new node_table()));
+  return r;
+}
+
+/** A mixed cube in the split layer, which is evaluated separately. */
+struct tile {
+  uint32_t x, y, z;
+  layer_tables layers;
+  entry root;
+  std::vector<std::vector<uint32_t>> ordinal; //< Global ordinal of every node in the tile.
+};
+
+/** Generates the octree of the model. The cubes in the split layer are evaluated in parallel with their own tables,
+ * which are merged layer by layer afterwards, such that the result does not depend on the number of threads.
+ * Then the layers above the split layer are evaluated. */
+void generate(const model &m, const char * filename) {
+  int top = m.depth;
+  int split = std::max(1, top - 5);
+
+  // Find the tiles, in the order in which they are stored.
+  layer_tables scratch = make_tables(top);
+  std::vector<tile> tiles;
+  evaluator find(m, scratch, split);
+  find.stop = [&](uint32_t x, uint32_t y, uint32_t z) {
+    tile t;
+    t.x = x; t.y = y; t.z = z;
+    tiles.push_back(std::move(t));
+    return entry(0, leaf_sum(0));
+  };
+  find.build(top, 0, 0, 0);
+  fprintf(stderr, "Evaluating %lu tiles in layer %d.\n", tiles.size(), split);
+
+  std::atomic<uint64_t> next(0);
+  parallel_ranges(thread_count(), [&](int, uint64_t, uint64_t) {
+    for (uint64_t i=next++; i<tiles.size(); i=next++) {
+      tile &t = tiles[i];
+      t.layers = make_tables(split);
+      evaluator e(m, t.layers);
+      t.root = e.build(split, t.x, t.y, t.z);
+    }
+  });
+
+  // Merge the tables of the tiles.
+  layer_tables layers = make_tables(top);
+  for (int k=1; k<=split; k++) {
+    for (tile &t : tiles) {
+      t.ordinal.resize(split + 1);
+      const node_table &local = *t.layers[k];
+      for (uint32_t i=0; i<local.size(); i++) {
+        uint32_t node[9];
+        const uint32_t * src = &local.words[local.offset[i]];
+        uint32_t n = popcount(src[0]>>24);
+        node[0] = src[0];
+        for (uint32_t j=1; j<=n; j++) node[j] = k > 1 ? t.ordinal[k-1][src[j]] : src[j];
+        t.ordinal[k].push_back(layers[k]->add(node, local.sums[i]));
+      }
+      if (k > 1) std::vector<uint32_t>().swap(t.ordinal[k-1]);
+      t.layers[k].reset();
+    }
+  }
+
+  // Evaluate the top layers, linking the tiles in the order in which they were found.
+  uint64_t cursor = 0;
+  evaluator link(m, layers, split);
+  link.stop = [&](uint32_t x, uint32_t y, uint32_t z) {
+    tile &t = tiles[cursor++];
+    assert(t.x == x && t.y == y && t.z == z);
+    (void)x; (void)y; (void)z;
+    if (!t.root.present) return entry();
+    return entry(t.ordinal[split][t.root.value], t.root.sum);
+  };
+  entry root = link.build(top, 0, 0, 0);
+  assert(cursor == tiles.size());
+  if (!root.present) {
+    fprintf(stderr, "The model is empty.\n");
+    exit(1);
+  }
+
+  // Determine the file structure. The top layer gets room for the root and 8 children, as in build_db.
+  uint32_t layer_start[octree_header::LAYERS] = {0};
+  uint32_t layer_end[octree_header::LAYERS] = {0};
+  layer_end[top] = 9;
+  for (int k=top-1; k>=1; k--) {
+    layer_start[k] = layer_end[k+1];
+    layer_end[k] = layer_start[k] + layers[k]->words.size();
+  }
+  uint64_t nodes = layer_end[1];
+  for (int k=top; k>=1; k--) {
+    fprintf(stderr, "At layer %2d: %8u distinct nodes.\n", k, layers[k]->size());
+  }
+  if (nodes * sizeof(octree) > OCTREE_MAX_FILESIZE) {
+    fprintf(stderr, "The octree is too large, reduce the depth.\n");
+    exit(1);
+  }
+  fprintf(stderr, "Writing %.0f leaves in %lu bytes.\n", (double)root.sum.n, nodes * sizeof(octree));
+
+  // Write the nodes, replacing the ordinals by their position in the file.
+  octree_file out(filename, nodes * sizeof(octree));
+  uint32_t * words = (uint32_t*)out.root;
+  for (int k=top; k>=1; k--) {
+    const node_table &table = *layers[k];
+    std::copy(table.words.begin(), table.words.end(), words + layer_start[k]);
+    if (k == 1) continue;
+    parallel_ranges(table.size(), [&](int, uint64_t begin, uint64_t end) {
+      for (uint64_t i=begin; i<end; i++) {
+        uint32_t * node = words + layer_start[k] + table.offset[i];
+        for (uint32_t j=1; j<=(uint32_t)popcount(node[0]>>24); j++) {
+          node[j] = layer_start[k-1] + layers[k-1]->offset[node[j]];
+        }
+      }
+    });
+  }
+  out.header.flags |= OCTREE_LAYERED | OCTREE_SHARED;
+  out.header.top_repeat_layer = top;
+  out.header.top_data_layer = top;
+  out.header.bottom_layer = 0;
+  for (int k=0; k<octree_header::LAYERS; k++) {
+    out.header.layer_start[k] = layer_start[k];
+    out.header.layer_end[k] = layer_end[k];
+  }
+}
+
+int main(int argc, char ** argv) {
+  int depth = 10;
+  uint32_t seed = 1;
+  int i = 1;
+  for (; i+1<argc && argv[i][0]=='-'; i+=2) {
+    if (strcmp(argv[i], "-depth") == 0) {
+      depth = atoi(argv[i+1]);
+    } else if (strcmp(argv[i], "-seed") == 0) {
+      seed = strtoul(argv[i+1], NULL, 10);
+    } else {
+      break;
+    }
+  }
+  if (argc - i != 2 || depth < 2 || depth >= octree_header::LAYERS) {
+    fprintf(stderr,"Usage: %s [-depth N] [-seed S] model output.oc2\n", argv[0]);
+    fprintf(stderr,"Generates a model of 2^N voxels wide, with 2 <= N <= 20 (default 10). The model is one of:\n");
+    fprintf(stderr,"  sponge  Menger sponge with 4x4x4 subdivision, which has at most 8 distinct nodes per layer.\n");
+    fprintf(stderr,"  sphere  Solid sphere.\n");
+    fprintf(stderr,"  torus   Solid torus.\n");
+    fprintf(stderr,"  noise   Terrain with a height given by fractal value noise, using the given seed.\n");
+    exit(2);
+  }
+  std::unique_ptr<model> m;
+  if (strcmp(argv[i], "sponge") == 0) {
+    m.reset(new sponge());
+  } else if (strcmp(argv[i], "sphere") == 0) {
+    m.reset(new sphere());
+  } else if (strcmp(argv[i], "torus") == 0) {
+    m.reset(new torus());
+  } else if (strcmp(argv[i], "noise") == 0) {
+    noise_terrain * n = new noise_terrain();
+    n->seed = seed;
+    m.reset(n);
+  } else {
+    fprintf(stderr,"Unknown model '%s'.\n", argv[i]);
+    exit(2);
+  }
+  m->depth = depth;
+  generate(*m, argv[i+1]);
+}
+
+// kate: space-indent on; indent-width 2; mixedindent off; indent-mode cstyle;
@@ -17,24 +17,19 @@
 */
 
 #include <cstdio>
+#include <cstring>
 #include <cassert>
 #include <algorithm>
+#include <atomic>
+#include <functional>
+#include <vector>
 #include <SDL2/SDL_image.h>
 #include <unistd.h>
-#include "pointset.h"
+#include "octree.h"
+#include "color.h"
+#include "parallel.h"
 #include "errno.h"
 
-SDL_PixelFormat fmt = {
-  NULL,
-  32,
-  4,
-  0,0,0,0,
-  16,8,0,24,
-  0xff0000, 0xff00, 0xff, 0xff000000,
-  0,
-  0
-};
-
 bool checkfile(char * buffer, const char * format, const char * name) __attribute__ ((format (printf, 2, 0)));
 bool checkfile(char * buffer, const char * format, const char * name) {
   sprintf(buffer, format, name);
@@ -94,6 +89,333 @@ uint32_t subsample_height(SDL_Surface* s, int x, int y) {
   return r;
 }
 
+/** Distance between the samples of adjacent columns, in the units of subsample_height and subsample_color. */
+static const int ds = 2;
+
+/** The terrain consists of a column of voxels for every sample of the heightmap.
+ * A column is filled from its top down to just above its lowest neighbor, such that there are no holes in the surface.
+ */
+struct terrain {
+  SDL_Surface * texture;
+  SDL_Surface * height;
+  int hrp;
+  uint32_t w, h; //< Number of columns in the x and z direction.
+  
+  /** Computes the lowest and highest voxel and the color of the column at (x, z). */
+  void column(int x, int z, uint32_t &lo, uint32_t &hi, uint32_t &color) const {
+    x *= ds;
+    z *= ds;
+    hi = subsample_height(height, x, z)>>hrp;
+    uint32_t n = std::min(std::min(std::min(
+        subsample_height(height, x-ds, z)>>hrp,
+        subsample_height(height, x+ds, z)>>hrp),
+        subsample_height(height, x, z-ds)>>hrp),
+        subsample_height(height, x, z+ds)>>hrp);
+    lo = std::min(n+1, hi);
+    color = subsample_color(texture, x, z);
+  }
+  
+  /** Computes bounds on the heights of the voxels in the given square of columns from the pixels of the heightmap, 
+   * which is cheaper than computing the columns. The bounds are empty if the square is outside the terrain. */
+  void bounds(uint32_t x, uint32_t z, uint32_t size, uint32_t &lo, uint32_t &hi) const {
+    lo = ~0u;
+    hi = 0;
+    if (x >= w || z >= h) return;
+    // Columns sample 2x2 pixels, and their neighbors are one pixel further.
+    int x0 = (int)(x/2) - 2, x1 = std::min(x + size, w)/2 + 2;
+    int z0 = (int)(z/2) - 2, z1 = std::min(z + size, h)/2 + 2;
+    uint32_t min = 255, max = 0;
+    for (int j=z0; j<=z1; j++) {
+      for (int i=x0; i<=x1; i++) {
+        uint32_t v = sample(height, i, j) & 0xff;
+        min = std::min(min, v);
+        max = std::max(max, v);
+      }
+    }
+    lo = (min<<4)>>hrp;
+    hi = (max<<4)>>hrp;
+  }
+};
+
+/** Pyramid of the lowest and highest voxels of the columns in a square area, 
+ * with level k storing the bounds of squares of 2^k columns. */
+struct height_pyramid {
+  uint32_t size; //< Number of squares along a side in level 0.
+  std::vector<std::vector<uint32_t>> lo, hi;
+  height_pyramid(uint32_t size, int levels) : size(size), lo(levels), hi(levels) {
+    for (int k=0; k<levels; k++) {
+      lo[k].resize((size>>k)*(size>>k), ~0u);
+      hi[k].resize((size>>k)*(size>>k), 0);
+    }
+  }
+  /** Computes the levels above level 0. */
+  void reduce() {
+    for (uint32_t k=1; k<lo.size(); k++) {
+      uint32_t n = size>>k;
+      for (uint32_t z=0; z<n; z++) {
+        for (uint32_t x=0; x<n; x++) {
+          uint32_t i = z*2*n*2 + x*2;
+          lo[k][z*n+x] = std::min(std::min(lo[k-1][i], lo[k-1][i+1]), std::min(lo[k-1][i+n*2], lo[k-1][i+n*2+1]));
+          hi[k][z*n+x] = std::max(std::max(hi[k-1][i], hi[k-1][i+1]), std::max(hi[k-1][i+n*2], hi[k-1][i+n*2+1]));
+        }
+      }
+    }
+  }
+  /** Checks whether the columns of square (x, z) in level k can contain voxels with a height from y0 to y1. */
+  bool intersects(int k, uint32_t x, uint32_t z, uint32_t y0, uint32_t y1) const {
+    uint32_t i = z*(size>>k) + x;
+    return y0 <= hi[k][i] && y1 >= lo[k][i];
+  }
+};
+
+/** The columns of a square of 2^tile columns, which are shared by the subtrees at different heights above that square. */
+struct tile_columns {
+  height_pyramid heights;
+  std::vector<uint32_t> colors;
+  
+  /** Computes the columns of the square with its lowest corner at column (x, z). */
+  tile_columns(const terrain &t, uint32_t x, uint32_t z, int tile) : heights(1<<tile, tile + 1), colors(1<<tile<<tile) {
+    uint32_t size = 1<<tile;
+    for (uint32_t j=0; j<size && z+j<t.h; j++) {
+      for (uint32_t i=0; i<size && x+i<t.w; i++) {
+        t.column(x+i, z+j, heights.lo[0][j*size+i], heights.hi[0][j*size+i], colors[j*size+i]);
+      }
+    }
+    heights.reduce();
+  }
+};
+
+/** A child array entry, which is a pointer relative to the start of the nodes in the layer below, or a leaf. */
+struct entry {
+  bool present;
+  uint32_t value;
+  color_sum sum;
+  entry() : present(false), value(0) {}
+  entry(uint32_t value, const color_sum &sum) : present(true), value(value), sum(sum) {}
+};
+
+/** Appends a node with the given children to nodes and returns its entry, or an empty entry if it has no children. */
+static entry add_node(std::vector<uint32_t> &nodes, const entry children[8]) {
+  uint32_t bitmask = 0;
+  color_sum sum;
+  for (int i=0; i<8; i++) {
+    if (children[i].present) {
+      bitmask |= 1<<i;
+      sum += children[i].sum;
+    }
+  }
+  if (!bitmask) return entry();
+  uint32_t index = nodes.size();
+  nodes.push_back(bitmask<<24 | sum.color());
+  for (int i=0; i<8; i++) {
+    if (children[i].present) nodes.push_back(children[i].value);
+  }
+  return entry(index, sum);
+}
+
+/** Part of the octree below a node in the tile layer, which covers a square of 2^tile columns. 
+ * Its nodes are stored per layer in the same order as in the file, such that the subtrees can be built in parallel 
+ * and concatenated afterwards. */
+struct subtree {
+  uint32_t x, y, z;  //< Position of the root in voxels.
+  std::vector<std::vector<uint32_t>> layers;
+  std::vector<uint32_t> offset; //< Position of the nodes of each layer relative to the start of the layer in the file.
+  entry root;
+  uint32_t lo, hi;   //< Lowest and highest voxel of the columns in the tile.
+  
+  /** Creates the nodes of the subtree from the columns of its tile. */
+  void build(const tile_columns &columns, int tile) {
+    lo = columns.heights.lo[tile][0];
+    hi = columns.heights.hi[tile][0];
+    layers.resize(tile + 1);
+    root = build(columns.heights, columns.colors, tile, 0, y, 0);
+  }
+  
+  /** Creates the node in layer k at (cx, y, cz), with cx and cz relative to the tile. */
+  entry build(const height_pyramid &columns, const std::vector<uint32_t> &colors, int k, uint32_t cx, uint32_t y, uint32_t cz) {
+    if (!columns.intersects(k, cx>>k, cz>>k, y, y + (1<<k) - 1)) return entry();
+    if (k == 0) {
+      uint32_t color = colors[cz*columns.size + cx];
+      return entry(0xff000000u | color, color_sum(color));
+    }
+    uint32_t half = 1<<(k-1);
+    entry children[8];
+    for (int i=0; i<8; i++) {
+      children[i] = build(columns, colors, k-1, cx + (i&4?half:0), y + (i&2?half:0), cz + (i&1?half:0));
+    }
+    return add_node(layers[k], children);
+  }
+};
+
+/** Copies the nodes of a layer to target, adding base to their pointers. */
+static void copy_nodes(uint32_t * target, const std::vector<uint32_t> &nodes, uint32_t base, bool leaves) {
+  for (uint32_t i=0; i<nodes.size(); ) {
+    uint32_t n = popcount(nodes[i]>>24);
+    target[i] = nodes[i];
+    for (uint32_t j=1; j<=n; j++) {
+      target[i+j] = leaves ? nodes[i+j] : nodes[i+j] + base;
+    }
+    i += 1 + n;
+  }
+}
+
+/** Builds the octree of the terrain directly, without creating points. 
+ * The octree is split at the tile layer into subtrees, which are built in parallel. Columns are only computed 
+ * for the tiles that can contain voxels, which are found using bounds obtained from the heightmap.
+ * Within a tile, a pyramid of the column heights is used to skip empty space.
+ * The nodes are stored per layer, top-down, as in build_db.
+ */
+void build_octree(const terrain &t, const char * filename) {
+  // Determine the number of layers.
+  uint32_t lo, hi;
+  t.bounds(0, 0, std::max(t.w, t.h), lo, hi);
+  int top = 2;
+  while ((1u<<top) < std::max(std::max(t.w, t.h), hi+1)) top++;
+  if (top >= octree_header::LAYERS) {
+    fprintf(stderr, "The terrain does not fit in %d layers.\n", octree_header::LAYERS - 1);
+    exit(1);
+  }
+  int tile = std::max(1, std::min(top - 1, 8));
+  
+  // Compute the height bounds of the tiles.
+  uint32_t tiles = 1<<(top - tile);
+  height_pyramid bounds(tiles, top - tile + 1);
+  parallel_ranges(tiles*tiles, [&](int, uint64_t begin, uint64_t end) {
+    for (uint64_t i=begin; i<end; i++) {
+      t.bounds((i%tiles)<<tile, (i/tiles)<<tile, 1<<tile, bounds.lo[0][i], bounds.hi[0][i]);
+    }
+  });
+  bounds.reduce();
+  
+  // Find the nodes in the tile layer that can contain voxels, in the order in which they are stored.
+  std::vector<subtree> subtrees;
+  std::function<void(int, uint32_t, uint32_t, uint32_t)> find = [&](int k, uint32_t x, uint32_t y, uint32_t z) {
+    if (!bounds.intersects(k - tile, x>>k, z>>k, y, y + (1<<k) - 1)) return;
+    if (k == tile) {
+      subtree s;
+      s.x = x; s.y = y; s.z = z;
+      subtrees.push_back(s);
+      return;
+    }
+    uint32_t half = 1<<(k-1);
+    for (int i=0; i<8; i++) {
+      find(k-1, x + (i&4?half:0), y + (i&2?half:0), z + (i&1?half:0));
+    }
+  };
+  find(top, 0, 0, 0);
+  
+  // Group the subtrees by their tile, as steep terrain has several subtrees above the same tile, 
+  // such that the columns of each tile are computed once.
+  std::vector<uint32_t> order(subtrees.size());
+  for (uint32_t i=0; i<order.size(); i++) order[i] = i;
+  auto tile_key = [&](uint32_t i) { return (uint64_t)subtrees[i].z << 32 | subtrees[i].x; };
+  std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return tile_key(a) < tile_key(b); });
+  std::vector<uint32_t> groups; //< Start of each group in order.
+  for (uint32_t i=0; i<order.size(); i++) {
+    if (i == 0 || tile_key(order[i]) != tile_key(order[i-1])) groups.push_back(i);
+  }
+  fprintf(stderr, "layers: %d, building %lu subtrees above %lu tiles of %d^2 columns\n", top, subtrees.size(), groups.size(), 1<<tile);
+  groups.push_back(order.size());
+  
+  // Build the subtrees, which take a varying amount of time, hence the threads take the next tile when done.
+  std::atomic<uint64_t> next(0);
+  parallel_ranges(thread_count(), [&](int, uint64_t, uint64_t) {
+    for (uint64_t g=next++; g+1<groups.size(); g=next++) {
+      const subtree &first = subtrees[order[groups[g]]];
+      tile_columns columns(t, first.x, first.z, tile);
+      for (uint32_t i=groups[g]; i<groups[g+1]; i++) {
+        subtrees[order[i]].build(columns, tile);
+      }
+    }
+  });
+  
+  // Create the nodes above the tile layer, which are linked to the subtrees in the same order as they were found.
+  std::vector<std::vector<uint32_t>> layers(top + 1);
+  uint64_t cursor = 0;
+  std::vector<uint32_t> layer_size(top + 1, 0);
+  for (subtree &s : subtrees) {
+    s.offset.resize(tile + 1);
+    for (int k=1; k<=tile; k++) {
+      s.offset[k] = layer_size[k];
+      layer_size[k] += s.layers[k].size();
+    }
+  }
+  std::function<entry(int, uint32_t, uint32_t, uint32_t)> link = [&](int k, uint32_t x, uint32_t y, uint32_t z) {
+    if (!bounds.intersects(k - tile, x>>k, z>>k, y, y + (1<<k) - 1)) return entry();
+    if (k == tile) {
+      subtree &s = subtrees[cursor++];
+      assert(s.x == x && s.y == y && s.z == z);
+      if (!s.root.present) return entry();
+      return entry(s.offset[tile] + s.root.value, s.root.sum);
+    }
+    uint32_t half = 1<<(k-1);
+    entry children[8];
+    for (int i=0; i<8; i++) {
+      children[i] = link(k-1, x + (i&4?half:0), y + (i&2?half:0), z + (i&1?half:0));
+    }
+    return add_node(layers[k], children);
+  };
+  entry root = link(top, 0, 0, 0);
+  assert(cursor == subtrees.size());
+  if (!root.present) {
+    fprintf(stderr, "The terrain is empty.\n");
+    exit(1);
+  }
+  
+  // Determine the file structure. The top layer gets room for the root and 8 children, as in build_db.
+  uint32_t layer_start[octree_header::LAYERS] = {0};
+  uint32_t layer_end[octree_header::LAYERS] = {0};
+  layer_end[top] = 9;
+  for (int k=top-1; k>=1; k--) {
+    layer_start[k] = layer_end[k+1];
+    layer_end[k] = layer_start[k] + (k > tile ? layers[k].size() : layer_size[k]);
+  }
+  uint64_t nodes = layer_end[1];
+  if (nodes * sizeof(octree) > OCTREE_MAX_FILESIZE) {
+    fprintf(stderr, "The octree is too large, increase the height reduction power.\n");
+    exit(1);
+  }
+  fprintf(stderr, "writing: %luMiB\n", nodes * sizeof(octree) >> 20);
+  
+  // Write the nodes.
+  octree_file out(filename, nodes * sizeof(octree));
+  uint32_t * words = (uint32_t*)out.root;
+  for (int k=top; k>tile; k--) {
+    copy_nodes(words + layer_start[k], layers[k], layer_start[k-1], false);
+  }
+  next = 0;
+  parallel_ranges(thread_count(), [&](int, uint64_t, uint64_t) {
+    for (uint64_t i=next++; i<subtrees.size(); i=next++) {
+      const subtree &s = subtrees[i];
+      for (int k=tile; k>=1; k--) {
+        copy_nodes(words + layer_start[k] + s.offset[k], s.layers[k], k > 1 ? layer_start[k-1] + s.offset[k-1] : 0, k == 1);
+      }
+    }
+  });
+  
+  // Describe the structure in the header.
+  out.header.flags |= OCTREE_LAYERED;
+  out.header.top_repeat_layer = top;
+  out.header.top_data_layer = top;
+  out.header.bottom_layer = 0;
+  out.header.repeat_depth = 0;
+  for (int k=0; k<octree_header::LAYERS; k++) {
+    out.header.layer_start[k] = layer_start[k];
+    out.header.layer_end[k] = layer_end[k];
+  }
+  uint32_t bottom = ~0u, highest = 0;
+  for (const subtree &s : subtrees) {
+    bottom = std::min(bottom, s.lo);
+    highest = std::max(highest, s.hi);
+  }
+  uint32_t bounds_min[3] = {0, bottom, 0};
+  uint32_t bounds_max[3] = {t.w - 1, highest, t.h - 1};
+  for (int i=0; i<3; i++) {
+    out.header.bounds_min[i] = bounds_min[i];
+    out.header.bounds_max[i] = bounds_max[i];
+  }
+}
+
 int main(int argc, const char ** argv) {
   if (argc != 3) {
     fprintf(stderr,"Please specify the file to convert (without 'input/', '-h', '.png' or '.jpg'), followed by the height reduction power.\n");
@@ -131,12 +453,16 @@ int main(int argc, const char ** argv) {
     fprintf(stderr,"Failed to open heightmap.\n");
     exit(1);
   }
-  sprintf(outfile, "vxl/%s.vxl", name);
+  sprintf(outfile, "vxl/%s.oc2", name);
   
   // Loading images
   IMG_Init(IMG_INIT_JPG | IMG_INIT_PNG);
-  SDL_Surface* texture = SDL_ConvertSurface(IMG_Load(infile), &fmt, SDL_SWSURFACE);
-  SDL_Surface* height  = SDL_ConvertSurface(IMG_Load(infileh), &fmt, SDL_SWSURFACE);
+  SDL_Surface* texture = IMG_Load(infile);
+  SDL_Surface* height  = IMG_Load(infileh);
+  assert(texture);
+  assert(height);
+  texture = SDL_ConvertSurfaceFormat(texture, SDL_PIXELFORMAT_ARGB8888, 0);
+  height  = SDL_ConvertSurfaceFormat(height,  SDL_PIXELFORMAT_ARGB8888, 0);
   assert(texture);
   assert(height);
 
@@ -146,34 +472,16 @@ int main(int argc, const char ** argv) {
   // Preparing
   assert(texture->w==height->w);
   assert(texture->h==height->h);
-  int w=texture->w;
-  int h=texture->h;
+  terrain t;
+  t.texture = texture;
+  t.height = height;
+  t.hrp = hrp;
+  t.w = texture->w*4/ds;
+  t.h = texture->h*4/ds;
   
   // Write output
-  pointfile out(outfile);
-  int points = 0;
-  int maxh = 0;
-  const int ds = 2;
-  for(int y=0;y<h*4;y+=ds) {
-    for(int x=0;x<w*4;x+=ds) {
-      int c = subsample_color(texture, x, y);
-      int z = subsample_height(height, x, y)>>hrp;
-      out.add(point(x/ds,z,y/ds,c));
-      maxh = std::max(maxh, z);
-      points++;
-      int n = std::min(std::min(std::min((
-          subsample_height(height, x-ds, y)>>hrp),
-          subsample_height(height, x+ds, y)>>hrp),
-          subsample_height(height, x, y-ds)>>hrp),
-          subsample_height(height, x, y+ds)>>hrp);
-      for (int i=n+1; i<z; i++) {
-        out.add(point(x/ds,i,y/ds,c));
-        points++;
-      }
-    }
-  }
-  fprintf(stderr, "wrote: %dMi points\n", points>>20);
-  fprintf(stderr, "maximum height: %d\n", maxh);
+  build_octree(t, outfile);
+  fprintf(stderr, "wrote: %s\n", outfile);
 }
  
 // kate: space-indent on; indent-width 2; mixedindent off; indent-mode cstyle; 
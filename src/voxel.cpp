@@ -36,15 +36,35 @@
 
 using namespace std;
 
+static const int32_t SCENE_DEPTH = 26;
+
+/** Returns a camera position in front of the model, based on the bounding box in the file header. */
+static glm::dvec3 initial_position(const octree_header &header) {
+    if (!header.has_bounds() || header.top_repeat_layer < 0) {
+        return glm::dvec3(0, 0, 0);
+    }
+    // The root node spans 2^top_repeat_layer voxels, which are mapped onto [-2^SCENE_DEPTH, 2^SCENE_DEPTH].
+    double scale = (double)(2<<SCENE_DEPTH) / (1<<header.top_repeat_layer);
+    glm::dvec3 low, high;
+    for (int i=0; i<3; i++) {
+        low[i]  = header.bounds_min[i] * scale - (1<<SCENE_DEPTH);
+        high[i] = (header.bounds_max[i] + 1) * scale - (1<<SCENE_DEPTH);
+    }
+    double extent = max(high.x - low.x, high.y - low.y);
+    return glm::dvec3((low.x + high.x) / 2, (low.y + high.y) / 2, low.z - extent);
+}
 
 ///////////////////////////////////////////////////////////////////////////////
 int main(int argc, char *argv[]) {
     bool capture = false;
+    octree_loading loading = OCTREE_MAPPED;
     const char * filename = nullptr;
     for (int i=1; i<argc; i++) { 
         if (argv[i][0]=='-') {
             if (strcmp(argv[i], "-capture") == 0) {
                 capture = true;
+            } else if (strcmp(argv[i], "-progressive") == 0) {
+                loading = OCTREE_PROGRESSIVE;
             } else {
                 fprintf(stderr,"unrecognized option: %s\n", argv[i]);
             }
@@ -55,15 +75,15 @@ int main(int argc, char *argv[]) {
     }
     if (filename == nullptr) {
         usage:
-        fprintf(stderr,"Usage: %s [-capture] octree_file\n", argv[0]);
+        fprintf(stderr,"Usage: %s [-capture] [-progressive] octree_file\n", argv[0]);
         exit(2);
     }
 
     // Determine the file names.
-    octree_file in(filename);
+    octree_file in(filename, loading);
 
     init_screen("Voxel renderer");
-    position = glm::dvec3(0, 0, 0);
+    position = initial_position(in.header);
     Capture c;
     if (capture) {
 #ifdef FOUND_LIBAV
@@ -84,9 +104,11 @@ int main(int argc, char *argv[]) {
 #endif
 
     // mainloop
+    uint32_t drawn = 0; // Number of resident nodes when the last frame was drawn.
     while (!quit) {
         Timer t;
-        if (moves) {
+        if (moves || in.resident != drawn) {
+            drawn = in.resident;
             surf.clear(0xaaccffu);
             octree_draw(&in, surf, get_view_pane(),position, orientation);
             // Timer tt;
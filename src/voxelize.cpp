@@ -0,0 +1,517 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
+#include <strings.h>
+#ifdef FOUND_SDL2_IMAGE
+# include <SDL2/SDL_image.h>
+#endif
+
+#include "ingest.h"
+#include "hilbert.h"
+
+/* Converts a triangle mesh in Wavefront OBJ format into points, one for each voxel that is touched by a triangle.
+ * The voxels are grouped into bins, which are voxelized in parallel. The bins are visited along the hilbert curve
+ * and the voxels in a bin are sorted, such that the points are written in the order that build_db uses.
+ */
+
+/** Number of layers spanned by a bin. */
+static const int BIN_LAYERS = 5;
+
+struct vec3 {
+  double v[3];
+  vec3() {}
+  vec3(double x, double y, double z) { v[0]=x; v[1]=y; v[2]=z; }
+  double operator[](int i) const { return v[i]; }
+  double &operator[](int i) { return v[i]; }
+  vec3 operator-(const vec3 &o) const { return vec3(v[0]-o[0], v[1]-o[1], v[2]-o[2]); }
+};
+
+static inline double dot(const vec3 &a, const vec3 &b) {
+  return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+}
+
+static inline vec3 cross(const vec3 &a, const vec3 &b) {
+  return vec3(a[1]*b[2] - a[2]*b[1], a[2]*b[0] - a[0]*b[2], a[0]*b[1] - a[1]*b[0]);
+}
+
+/** Tests whether the triangle overlaps the axis aligned box with the given center and half size,
+ * using the separating axis theorem. Touching counts as overlapping, hence the test is conservative.
+ */
+static bool overlaps(const vec3 tri[3], const vec3 &center, double half) {
+  vec3 v[3] = {tri[0] - center, tri[1] - center, tri[2] - center};
+  for (int i=0; i<3; i++) {
+    if (std::min({v[0][i], v[1][i], v[2][i]}) > half || std::max({v[0][i], v[1][i], v[2][i]}) < -half) return false;
+  }
+  vec3 e[3] = {v[1] - v[0], v[2] - v[1], v[0] - v[2]};
+  vec3 n = cross(e[0], e[1]);
+  if (fabs(dot(n, v[0])) > half * (fabs(n[0]) + fabs(n[1]) + fabs(n[2]))) return false;
+  for (int i=0; i<3; i++) {
+    for (int j=0; j<3; j++) {
+      vec3 unit(0, 0, 0);
+      unit[j] = 1;
+      vec3 a = cross(unit, e[i]);
+      double p0 = dot(a, v[0]), p1 = dot(a, v[1]), p2 = dot(a, v[2]);
+      double r = half * (fabs(a[0]) + fabs(a[1]) + fabs(a[2]));
+      if (std::min({p0, p1, p2}) > r || std::max({p0, p1, p2}) < -r) return false;
+    }
+  }
+  return true;
+}
+
+struct texture {
+  int w, h;
+  std::vector<uint32_t> pixels;
+  /** Returns the nearest texel, repeating the texture. The origin of the texture coordinates is the bottom left. */
+  uint32_t sample(double u, double v) const {
+    int x = (int)floor(u * w) % w;
+    int y = (int)floor((1 - v) * h) % h;
+    if (x < 0) x += w;
+    if (y < 0) y += h;
+    return pixels[y * w + x] & 0xffffff;
+  }
+};
+
+struct material {
+  std::string name;
+  uint32_t color;  //< The diffuse color.
+  int texture;     //< The diffuse texture, or -1 if there is none.
+};
+
+struct triangle {
+  uint32_t v[3];   //< Indices of the vertices.
+  int32_t t[3];    //< Indices of the texture coordinates, or -1.
+  int32_t material;//< Index of the material, or -1.
+};
+
+static const uint32_t NO_COLOR = ~0u;
+
+struct mesh {
+  std::vector<vec3> positions;
+  std::vector<uint32_t> colors;   //< Color of each vertex, or NO_COLOR.
+  std::vector<double> texcoords;  //< The u and v of each texture coordinate.
+  std::vector<triangle> triangles;
+  std::vector<material> materials;
+  std::vector<texture> textures;
+
+  /** Returns the color of the triangle at the point with the given barycentric coordinates.
+   * Textures take precedence over vertex colors, which take precedence over the material color. */
+  uint32_t color(const triangle &t, const double b[3]) const {
+    const material * m = t.material >= 0 ? &materials[t.material] : nullptr;
+    if (m && m->texture >= 0 && t.t[0] >= 0) {
+      double u = 0, v = 0;
+      for (int i=0; i<3; i++) {
+        u += b[i] * texcoords[2*t.t[i]];
+        v += b[i] * texcoords[2*t.t[i]+1];
+      }
+      return textures[m->texture].sample(u, v);
+    }
+    if (colors[t.v[0]] != NO_COLOR && colors[t.v[1]] != NO_COLOR && colors[t.v[2]] != NO_COLOR) {
+      uint32_t c = 0;
+      for (int s=0; s<24; s+=8) {
+        double v = 0;
+        for (int i=0; i<3; i++) v += b[i] * ((colors[t.v[i]] >> s) & 0xff);
+        c |= std::min((uint32_t)(v + 0.5), 255u) << s;
+      }
+      return c;
+    }
+    return m ? m->color : 0xffffff;
+  }
+};
+
+/** Skips spaces and the given keyword, which must be followed by a space or the end of the line. */
+static bool keyword(const char *&p, const char * end, const char * word) {
+  const char * q = p;
+  skip_spaces(q, end);
+  int n = strlen(word);
+  if (end - q < n || memcmp(q, word, n) != 0 || (q + n < end && q[n] != ' ' && q[n] != '\t' && q[n] != '\r')) return false;
+  p = q + n;
+  return true;
+}
+
+/** Returns the remainder of the line without surrounding spaces. */
+static std::string rest(const char * p, const char * end) {
+  skip_spaces(p, end);
+  while (end > p && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) end--;
+  return std::string(p, end);
+}
+
+/** Returns the path of a file that is referred to by the file at the given path. */
+static std::string relative(const std::string &path, const std::string &file) {
+  size_t slash = path.rfind('/');
+  return slash == std::string::npos || file[0] == '/' ? file : path.substr(0, slash + 1) + file;
+}
+
+static uint32_t parse_color(const char * p, const char * end) {
+  double c[3];
+  if (!(parse_double(p, end, c[0]) && parse_double(p, end, c[1]) && parse_double(p, end, c[2]))) return 0xffffff;
+  uint32_t r = 0;
+  for (int i=0; i<3; i++) r = r << 8 | (uint32_t)(std::min(std::max(c[i], 0.), 1.) * 255 + 0.5);
+  return r;
+}
+
+static int load_texture(mesh &m, const std::string &filename) {
+#ifdef FOUND_SDL2_IMAGE
+  SDL_Surface * image = IMG_Load(filename.c_str());
+  if (!image) {
+    fprintf(stderr, "Could not load texture '%s'.\n", filename.c_str());
+    return -1;
+  }
+  SDL_Surface * converted = SDL_ConvertSurfaceFormat(image, SDL_PIXELFORMAT_ARGB8888, 0);
+  texture t;
+  t.w = converted->w;
+  t.h = converted->h;
+  t.pixels.resize(t.w * t.h);
+  for (int y=0; y<t.h; y++) {
+    memcpy(&t.pixels[y * t.w], (const char*)converted->pixels + y * converted->pitch, t.w * 4);
+  }
+  if (converted != image) SDL_FreeSurface(converted);
+  SDL_FreeSurface(image);
+  m.textures.push_back(t);
+  return m.textures.size() - 1;
+#else
+  static bool warned = false;
+  if (!warned) fprintf(stderr, "Textures are not supported without SDL2_image, using the material colors instead.\n");
+  warned = true;
+  (void)m; (void)filename;
+  return -1;
+#endif
+}
+
+static void load_materials(mesh &m, const std::string &filename) {
+  textfile in(filename.c_str());
+  for (const char * line = in.data; line < in.end; line = in.next_line(line)) {
+    const char * p = line;
+    const char * eol = (const char*)memchr(line, '\n', in.end - line);
+    if (!eol) eol = in.end;
+    if (keyword(p, eol, "newmtl")) {
+      material mat;
+      mat.name = rest(p, eol);
+      mat.color = 0xffffff;
+      mat.texture = -1;
+      m.materials.push_back(mat);
+    } else if (m.materials.empty()) {
+      continue;
+    } else if (keyword(p, eol, "Kd")) {
+      m.materials.back().color = parse_color(p, eol);
+    } else if (keyword(p, eol, "map_Kd")) {
+      // The file name is the last word, as it can be preceded by options.
+      std::string args = rest(p, eol);
+      size_t space = args.find_last_of(" \t");
+      std::string file = space == std::string::npos ? args : args.substr(space + 1);
+      m.materials.back().texture = load_texture(m, relative(filename, file));
+    }
+  }
+}
+
+/** Reads the OBJ file. Faces are split into triangles and lines that cannot be parsed are skipped. */
+static void load_mesh(mesh &m, const char * filename) {
+  textfile in(filename);
+  int32_t current = -1;
+  uint64_t skipped = 0;
+  for (const char * line = in.data; line < in.end; line = in.next_line(line)) {
+    const char * p = line;
+    const char * eol = (const char*)memchr(line, '\n', in.end - line);
+    if (!eol) eol = in.end;
+    if (keyword(p, eol, "v")) {
+      double x, y, z;
+      if (!(parse_double(p, eol, x) && parse_double(p, eol, y) && parse_double(p, eol, z))) {skipped++; continue;}
+      m.positions.push_back(vec3(x, y, z));
+      // Some exporters append the vertex color as 3 numbers in [0,1].
+      const char * q = p;
+      double c;
+      m.colors.push_back(parse_double(q, eol, c) ? parse_color(p, eol) : NO_COLOR);
+    } else if (keyword(p, eol, "vt")) {
+      double u, v = 0;
+      if (!parse_double(p, eol, u)) {skipped++; continue;}
+      parse_double(p, eol, v);
+      m.texcoords.push_back(u);
+      m.texcoords.push_back(v);
+    } else if (keyword(p, eol, "f")) {
+      // Vertices are given as v, v/vt, v//vn or v/vt/vn, with negative indices relative to the end.
+      std::vector<uint32_t> v;
+      std::vector<int32_t> t;
+      bool valid = true;
+      int64_t i;
+      while (parse_int(p, eol, i)) {
+        i = i < 0 ? (int64_t)m.positions.size() + i : i - 1;
+        valid &= i >= 0 && i < (int64_t)m.positions.size();
+        v.push_back(i);
+        int64_t j = 0;
+        if (p < eol && *p == '/') {
+          p++;
+          if (parse_int(p, eol, j)) {
+            j = j < 0 ? (int64_t)m.texcoords.size()/2 + j : j - 1;
+            valid &= j >= 0 && j < (int64_t)m.texcoords.size()/2;
+          } else {
+            j = -1;
+          }
+          if (p < eol && *p == '/') {
+            int64_t normal;
+            p++;
+            parse_int(p, eol, normal);
+          }
+        } else {
+          j = -1;
+        }
+        t.push_back(j);
+      }
+      if (!valid || v.size() < 3) {skipped++; continue;}
+      for (uint32_t k=2; k<v.size(); k++) {
+        triangle tri = {{v[0], v[k-1], v[k]}, {t[0], t[k-1], t[k]}, current};
+        if (t[0] < 0 || t[k-1] < 0 || t[k] < 0) tri.t[0] = -1;
+        m.triangles.push_back(tri);
+      }
+    } else if (keyword(p, eol, "mtllib")) {
+      load_materials(m, relative(filename, rest(p, eol)));
+    } else if (keyword(p, eol, "usemtl")) {
+      std::string name = rest(p, eol);
+      current = -1;
+      for (uint32_t k=0; k<m.materials.size(); k++) {
+        if (m.materials[k].name == name) current = k;
+      }
+      if (current < 0) fprintf(stderr, "Material '%s' is not defined.\n", name.c_str());
+    }
+  }
+  if (skipped) fprintf(stderr, "Skipped %lu lines that could not be parsed.\n", skipped);
+}
+
+/** A cube of 2^BIN_LAYERS voxels with the triangles that overlap it. */
+struct bin {
+  uint32_t x, y, z;
+  std::vector<uint32_t> triangles;
+};
+
+/** A voxel that is touched by a triangle. */
+struct hit {
+  uint64_t key;
+  point p;
+  bool operator<(const hit &o) const { return key < o.key; }
+};
+
+/** Computes the barycentric coordinates of the point of the triangle closest to c, approximately. */
+static void barycentric(const vec3 tri[3], const vec3 &c, double b[3]) {
+  vec3 e0 = tri[1] - tri[0], e1 = tri[2] - tri[0], d = c - tri[0];
+  double d00 = dot(e0, e0), d01 = dot(e0, e1), d11 = dot(e1, e1);
+  double d20 = dot(d, e0), d21 = dot(d, e1);
+  double denom = d00 * d11 - d01 * d01;
+  if (denom <= 0) {
+    b[0] = b[1] = b[2] = 1/3.;
+    return;
+  }
+  b[1] = std::max((d11 * d20 - d01 * d21) / denom, 0.);
+  b[2] = std::max((d00 * d21 - d01 * d20) / denom, 0.);
+  b[0] = std::max(1 - b[1] - b[2], 0.);
+  double sum = b[0] + b[1] + b[2];
+  for (int i=0; i<3; i++) b[i] /= sum;
+}
+
+/** Adds the voxels within [lo, hi] that overlap the triangle to hits.
+ * The voxels are visited in columns along the axis in which the triangle is the flattest,
+ * such that only the voxels near the plane of the triangle are tested.
+ */
+static void rasterize(const mesh &m, const triangle &t, const vec3 tri[3], const int64_t lo[3], const int64_t hi[3], std::vector<hit> &hits) {
+  vec3 n = cross(tri[1] - tri[0], tri[2] - tri[0]);
+  int d = fabs(n[0]) >= fabs(n[1]) && fabs(n[0]) >= fabs(n[2]) ? 0 : fabs(n[1]) >= fabs(n[2]) ? 1 : 2;
+  int a = (d + 1) % 3, b = (d + 2) % 3;
+  double plane = dot(n, tri[0]);
+  int64_t v[3];
+  for (v[a]=lo[a]; v[a]<=hi[a]; v[a]++) {
+    for (v[b]=lo[b]; v[b]<=hi[b]; v[b]++) {
+      int64_t k0 = lo[d], k1 = hi[d];
+      if (n[d] != 0) {
+        // The range of the plane within the column is attained at its corners.
+        double min = HUGE_VAL, max = -HUGE_VAL;
+        for (int c=0; c<4; c++) {
+          double h = (plane - n[a] * (v[a] + (c&1)) - n[b] * (v[b] + (c>>1))) / n[d];
+          min = std::min(min, h);
+          max = std::max(max, h);
+        }
+        k0 = std::max(k0, (int64_t)floor(min));
+        k1 = std::min(k1, (int64_t)floor(max));
+      }
+      for (v[d]=k0; v[d]<=k1; v[d]++) {
+        vec3 center(v[0] + 0.5, v[1] + 0.5, v[2] + 0.5);
+        if (!overlaps(tri, center, 0.5)) continue;
+        double bary[3];
+        barycentric(tri, center, bary);
+        hit h;
+        h.p = point(v[0], v[1], v[2], m.color(t, bary));
+        h.key = hilbert3d(h.p);
+        hits.push_back(h);
+      }
+    }
+  }
+}
+
+/** Voxelizes the triangles of the bin into points sorted along the hilbert curve.
+ * Voxels that are touched by multiple triangles get their average color. */
+static void voxelize(const mesh &m, const std::vector<vec3> &voxels, uint32_t size, const bin &b, std::vector<point> &points) {
+  std::vector<hit> hits;
+  const int64_t origin[3] = {b.x, b.y, b.z};
+  for (uint32_t i : b.triangles) {
+    const triangle &t = m.triangles[i];
+    vec3 tri[3] = {voxels[t.v[0]], voxels[t.v[1]], voxels[t.v[2]]};
+    int64_t lo[3], hi[3];
+    for (int j=0; j<3; j++) {
+      lo[j] = std::max<int64_t>(floor(std::min({tri[0][j], tri[1][j], tri[2][j]})), origin[j]);
+      hi[j] = std::min<int64_t>(floor(std::max({tri[0][j], tri[1][j], tri[2][j]})), std::min<int64_t>(origin[j] + (1<<BIN_LAYERS), size) - 1);
+    }
+    rasterize(m, t, tri, lo, hi, hits);
+  }
+  std::sort(hits.begin(), hits.end());
+  points.clear();
+  for (uint64_t i=0; i<hits.size(); ) {
+    uint64_t j = i;
+    uint32_t r = 0, g = 0, b = 0, n = 0;
+    for (; j<hits.size() && hits[j].key == hits[i].key; j++, n++) {
+      r += (hits[j].p.c >> 16) & 0xff;
+      g += (hits[j].p.c >> 8) & 0xff;
+      b += hits[j].p.c & 0xff;
+    }
+    point p = hits[i].p;
+    p.c = (2*r+n)/(2*n) << 16 | (2*g+n)/(2*n) << 8 | (2*b+n)/(2*n);
+    points.push_back(p);
+    i = j;
+  }
+}
+
+int main(int argc, char ** argv) {
+  int depth = 12;
+  if (argc >= 3 && strcmp(argv[1], "-depth") == 0) {
+    depth = atoi(argv[2]);
+    argc -= 2;
+    argv += 2;
+  }
+  if ((argc != 2 && argc != 3) || depth < 1 || depth > 20) {
+    fprintf(stderr,"Usage: voxelize [-depth N] model.obj [output]\n");
+    fprintf(stderr,"Converts the triangles of an OBJ file into the voxels that they touch, such that the longest side of\n");
+    fprintf(stderr,"their bounding box spans 2^N voxels (default 12). The output file defaults to 'vxl/model.vxl',\n");
+    fprintf(stderr,"use - to write to standard output.\n");
+    exit(2);
+  }
+  // Determine the file names.
+  const char * infile = argv[1];
+  const char * base = strrchr(infile, '/');
+  std::string name = base ? base + 1 : infile;
+  if (name.size() > 4 && strcasecmp(name.c_str() + name.size() - 4, ".obj") == 0) name.resize(name.size() - 4);
+  std::string outfile = "vxl/" + name + ".vxl";
+  const char * output = argc == 3 ? argv[2] : outfile.c_str();
+
+#ifdef FOUND_SDL2_IMAGE
+  IMG_Init(IMG_INIT_JPG | IMG_INIT_PNG);
+#endif
+  mesh m;
+  load_mesh(m, infile);
+  fprintf(stderr, "vertices: %lu, triangles: %lu, materials: %lu, textures: %lu\n",
+          m.positions.size(), m.triangles.size(), m.materials.size(), m.textures.size());
+  if (m.triangles.empty()) {
+    fprintf(stderr, "The file does not contain any faces.\n");
+    exit(1);
+  }
+
+  // Convert the vertices to voxel coordinates, in which voxel i spans [i, i+1).
+  quantizer q;
+  for (const vec3 &p : m.positions) q.add(p[0], p[1], p[2]);
+  q.fit(depth);
+  fprintf(stderr,"bounds: (%g, %g, %g) - (%g, %g, %g), %g voxels per unit\n", q.min[0], q.min[1], q.min[2], q.max[0], q.max[1], q.max[2], q.scale);
+  std::vector<vec3> voxels(m.positions.size());
+  for (uint32_t i=0; i<voxels.size(); i++) {
+    for (int j=0; j<3; j++) voxels[i][j] = (m.positions[i][j] - q.min[j]) * q.scale + 0.5;
+  }
+  uint32_t size = 1<<depth;
+
+  // Assign the triangles to the bins that they overlap, which are ordered along the hilbert curve.
+  int layers = std::min(depth, BIN_LAYERS);
+  std::vector<std::map<uint64_t, bin>> parts(thread_count());
+  parallel_ranges(m.triangles.size(), [&](int thread, uint64_t begin, uint64_t end) {
+    for (uint64_t i=begin; i<end; i++) {
+      const triangle &t = m.triangles[i];
+      vec3 tri[3] = {voxels[t.v[0]], voxels[t.v[1]], voxels[t.v[2]]};
+      uint32_t lo[3], hi[3];
+      for (int j=0; j<3; j++) {
+        lo[j] = std::max(floor(std::min({tri[0][j], tri[1][j], tri[2][j]})), 0.);
+        hi[j] = std::min(floor(std::max({tri[0][j], tri[1][j], tri[2][j]})), size - 1.);
+        lo[j] >>= layers;
+        hi[j] >>= layers;
+      }
+      bool single = lo[0] == hi[0] && lo[1] == hi[1] && lo[2] == hi[2];
+      for (uint32_t x=lo[0]; x<=hi[0]; x++) {
+        for (uint32_t y=lo[1]; y<=hi[1]; y++) {
+          for (uint32_t z=lo[2]; z<=hi[2]; z++) {
+            double half = 1<<(layers - 1);
+            if (!single && !overlaps(tri, vec3((x<<layers) + half, (y<<layers) + half, (z<<layers) + half), half)) continue;
+            bin &b = parts[thread][hilbert3d(point(x<<layers, y<<layers, z<<layers, 0)) >> 3*layers];
+            b.x = x<<layers;
+            b.y = y<<layers;
+            b.z = z<<layers;
+            b.triangles.push_back(i);
+          }
+        }
+      }
+    }
+  });
+  std::map<uint64_t, bin> merged;
+  for (std::map<uint64_t, bin> &part : parts) {
+    for (auto &entry : part) {
+      bin &b = merged[entry.first];
+      b.x = entry.second.x;
+      b.y = entry.second.y;
+      b.z = entry.second.z;
+      b.triangles.insert(b.triangles.end(), entry.second.triangles.begin(), entry.second.triangles.end());
+    }
+    std::map<uint64_t, bin>().swap(part);
+  }
+  std::vector<bin> bins;
+  for (auto &entry : merged) bins.push_back(std::move(entry.second));
+  std::map<uint64_t, bin>().swap(merged);
+  fprintf(stderr, "bins: %lu of %d^3 voxels\n", bins.size(), 1<<layers);
+
+  // Voxelize the bins in parallel, in batches that are written in order.
+  pointfile out(output);
+  const uint64_t BATCH = 16 * thread_count();
+  std::vector<std::vector<point>> points(BATCH);
+  uint64_t total = 0;
+  for (uint64_t begin=0; begin<bins.size(); begin+=BATCH) {
+    uint64_t end = std::min(begin + BATCH, bins.size());
+    std::atomic<uint64_t> next(begin);
+    parallel_ranges(thread_count(), [&](int, uint64_t, uint64_t) {
+      for (uint64_t i=next++; i<end; i=next++) {
+        voxelize(m, voxels, size, bins[i], points[i - begin]);
+      }
+    });
+    for (uint64_t i=begin; i<end; i++) {
+      out.add_many(points[i - begin].data(), points[i - begin].size());
+      total += points[i - begin].size();
+    }
+    if (end == bins.size() || (end / BATCH) % 64 == 0) {
+      fprintf(stderr, "points: %3luMi, %3.0f%%\n", total >> 20, end * 100. / bins.size());
+    }
+  }
+  fprintf(stderr, "voxels: %lu\n", total);
+}
+
+// kate: space-indent on; indent-width 2; mixedindent off; indent-mode cstyle;